@@ -69,20 +69,127 @@
  * calculated (or provided) time. Also, we use `wait until` type of API to wait
  * for a timeout instead of a `wait for` API.
  *
+ * All timeouts that have expired when the timer thread wakes up are handled
+ * as one batch. They are taken from the queue under one lock, their handlers
+ * are invoked without holding the lock, and periodic timeouts are then renewed
+ * together. If a handler removes another timeout of the same batch, that
+ * timeout is not invoked.
+ *
+ * By default, the handlers run on the timer thread, so a slow handler delays
+ * all other timeouts. A timer can instead be created with an `executor`, e.g.
+ * a `thread_pool`, that runs the handlers on other threads.
+ *
+ * `reschedule()` moves a timeout to a new time and keeps its id and handler.
+ * A later time is only stored in the event and the queue entry is moved when
+ * it expires, so a timeout that is postponed often is cheap to keep alive.
+ * A timeout added with `add_soft()` goes further: `extend()` only stores the
+ * new deadline, and the queue entry is moved when it reaches the old one.
+ *
+ * On Linux, `timer_options::kernel_wait` lets the timer thread wait in
+ * `epoll_wait()` on a timerfd armed to the next deadline. It is then woken up
+ * through an eventfd instead of the condition variable.
+ *
+ * The timer thread is only woken up if a new timeout expires before the one it
+ * is waiting for. `stats()` counts the wakeups of the timer thread.
+ * `add_bulk()` and `remove_bulk()` add or remove many timeouts under one lock,
+ * and wake up the timer thread at most once.
+ *
+ * With `timer_options::slack`, a timeout may fire up to the slack after its
+ * deadline. Timeouts with nearby deadlines then fire in one wakeup. `stats()`
+ * also reports how late the timeouts were taken from the queue.
+ *
+ * Timeouts added with `add_precise()` are kept in a second queue. For them,
+ * the timer thread blocks until `timer_options::spin_margin` before the
+ * deadline and spins on the clock for the rest, which avoids the wakeup latency
+ * of the scheduler.
+ *
+ * With `timer_options::poll`, no timer thread is started. The owner asks
+ * `next_deadline()` how long it may wait, and runs the expired handlers on its
+ * own thread with `process_expired()`. Used from one thread, such a timer
+ * needs no lock at all (`null_lock`).
+ * On Linux, `timer_options::pollable` adds a timerfd that is kept armed to
+ * the next deadline (`fd()`), so that an epoll loop can wait for timeouts and
+ * other descriptors at once and then call `dispatch_ready()`.
+ *
+ * The clock is a template parameter. Besides the `std::chrono` clocks,
+ * `coarse_clock` (`CLOCK_MONOTONIC_COARSE` on Linux), `tsc_clock` (the time
+ * stamp counter of x86 CPUs) and `cached_clock` are cheaper to read. The timer
+ * thread reads a `cached_clock` exactly once per batch, and `add()` and the
+ * handlers get that time for the cost of a load.
+ * With a clock that can be set, like `manual_clock`, `run_until()` does not
+ * wait at all. It jumps the clock from one deadline to the next, which makes
+ * the timer usable as the scheduler of a discrete-event simulation.
+ *
+ * Adding and removing timeouts takes the lock of the timer. With
+ * `timer_options::lock_free_submit`, these calls are instead passed to the
+ * timer thread through a lock-free queue, and the ids are taken from a
+ * lock-free stack of free slots. This helps if many threads add timeouts
+ * concurrently.
+ *
  * Data Structure
  * --------------
  *
- * Internally, a std::vector is used to store timeout events. The timer_id
- * returned from the `add` functions are used as index to this vector.
+ * Internally, a slab of chunks that are never moved is used to store timeout
+ * events. The timer_id returned from the `add` functions is used as index to
+ * this slab. The scheduling data and the handlers are kept in separate arrays.
+ *
+ * In addition, a queue is used that holds all time points when timeouts
+ * expire. The queue is a template parameter of `basic_timer`, and `Timer` is
+ * the default instantiation. Three queues are available.
+ *
+ * - `multiset_queue` keeps the time points in a std::multiset. Adding and
+ *   removing a timeout is O(log n). This is the default.
+ * - `heap_queue` keeps the time points in an indexed 4-ary min-heap that is
+ *   stored in a single std::vector. Adding and removing a timeout is
+ *   O(log n), without allocating memory per timeout.
+ * - `wheel_queue` is a hierarchical timing wheel (Varghese and Lauck). Adding,
+ *   removing and expiring a timeout is O(1). The wheel has a fixed resolution
+ *   (the tick) and a timeout may fire up to one tick late. The tick and the
+ *   number of levels are template parameters.
+ *
+ * Each queue keeps the position of every time event by timer_id, so removing
+ * a timeout does not need to search the queue.
+ *
+ * Using a slab to store timeout events has some implications. It is very
+ * fast to remove an event, because the timer_id contains the slab's index
+ * (the slot). On the other hand, this makes it also more complicated to manage
+ * the timer_ids. The current solution is to keep track of slots that are freed
+ * in order to re-use them. A stack is used for this.
+ *
+ * Each timer_id also contains a generation that is incremented whenever its
+ * slot is re-used. `remove()` with the id of a timeout that has expired or has
+ * been removed is therefore rejected, even if the slot has been re-used by a
+ * newer timeout.
+ *
+ * Policies
+ * --------
+ *
+ * `basic_timer` is a template that takes the queue, the clock, the handler
+ * type, the lock and the allocator as policies. `Timer` uses a
+ * `multiset_queue`, the `std::chrono::steady_clock`, a `std::function` handler,
+ * a `std::mutex` and a `std::allocator`.
+ * Another combination can be selected at compile time, e.g.
+ *
+ * ~~~
+ * using Net_timer = CppTime::basic_timer<CppTime::wheel_queue<>, std::chrono::steady_clock,
+ *     CppTime::handler_t, CppTime::spin_lock>;
+ * ~~~
+ *
+ * The handler type `inplace_handler` stores the callable inline instead of on
+ * the heap. Together with `heap_queue` or `wheel_queue`, adding and firing
+ * timeouts does not allocate memory once the timer has reached its working
+ * size.
  *
- * In addition, a std::multiset is used that holds all time points when
- * timeouts expire.
+ * The allocator is passed to the constructor and provides the memory of the
+ * events, the queue and the commands of `lock_free_submit`. It may be any
+ * C++11 allocator, e.g. a `std::pmr::polymorphic_allocator<char>`.
+ *
+ * Sharding
+ * --------
  *
- * Using a vector to store timeout events has some implications. It is very
- * fast to remove an event, because the timer_id is the vector's index. On the
- * other hand, this makes it also more complicated to manage the timer_ids. The
- * current solution is to keep track of ids that are freed in order to re-use
- * them. A stack is used for this.
+ * A timer has one lock, one queue and one thread. `ShardedTimer` runs several
+ * timers (shards) side by side, typically one per CPU, and adds each timeout
+ * to the shard of the calling CPU or to one selected by a key.
  *
  * Examples
  * --------
@@ -94,24 +201,54 @@
  * t.add(std::chrono::seconds(1), [](CppTime::timer_id){ std::cout << "got it!"; });
  * std::this_thread::sleep_for(std::chrono::seconds(2));
  * ~~~
+ *
+ * A timer that uses a timing wheel with a resolution of 1ms.
+ *
+ * ~~~
+ * CppTime::basic_timer<CppTime::wheel_queue<std::chrono::milliseconds>> t;
+ * ~~~
  */
 
 // Includes
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <set>
-#include <stack>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <x86intrin.h>
+#define CPPTIME_HAS_TSC 1
+#endif
+
 namespace CppTime
 {
 
 // Public types
-using timer_id = std::size_t;
+using timer_id = std::uint64_t;
 using handler_t = std::function<void(timer_id)>;
 using clock = std::chrono::steady_clock;
 using timestamp = std::chrono::time_point<clock>;
@@ -121,197 +258,3294 @@ using duration = std::chrono::microseconds;
 namespace detail
 {
 
-// The event structure that holds the information about a timer.
+// The scheduling data of a timer. The handler is kept separately, see
+// `Event_slab`.
+template <class Clock>
 struct Event {
 	timer_id id;
-	timestamp start;
+	// The time at which the event expires (or has expired) the next time.
+	typename Clock::time_point next;
 	duration period;
-	handler_t handler;
 	bool valid;
+	// Set if the event was rescheduled while its handler ran. It is then renewed
+	// at `next` instead of being freed or renewed by its period.
+	bool rearm;
+	// Set if the deadline may be extended without the lock, see `Shared_event`.
+	bool soft;
+	// Set if the event is kept in the queue of precise events.
+	bool precise;
 	Event()
-	    : id(0), start(duration::zero()), period(duration::zero()), handler(nullptr), valid(false)
+	    : id(0), next(duration::zero()), period(duration::zero()), valid(false), rearm(false),
+	      soft(false), precise(false)
 	{
 	}
-	template <typename Func>
-	Event(timer_id id, timestamp start, duration period, Func &&handler)
-	    : id(id), start(start), period(period), handler(std::forward<Func>(handler)), valid(true)
+	Event(timer_id id, typename Clock::time_point next, duration period, bool soft = false,
+	    bool precise = false)
+	    : id(id), next(next), period(period), valid(true), rearm(false), soft(soft),
+	      precise(precise)
 	{
 	}
-	Event(Event &&r) = default;
-	Event &operator=(Event &&ev) = default;
-	Event(const Event &r) = delete;
-	Event &operator=(const Event &r) = delete;
 };
 
 // A time event structure that holds the next timeout and a reference to its
-// Event struct.
+// Event struct (the slot).
+template <class Clock>
 struct Time_event {
-	timestamp next;
+	typename Clock::time_point next;
 	timer_id ref;
 };
 
-inline bool operator<(const Time_event &l, const Time_event &r)
+template <class Clock>
+inline bool operator<(const Time_event<Clock> &l, const Time_event<Clock> &r)
 {
 	return l.next < r.next;
 }
 
-} // end namespace detail
+// A timer_id holds the index of the event (the slot) in its lower 32 bits and
+// a generation in the next 24 bits. The upper 8 bits are zero, and are used by
+// `basic_sharded_timer` for the index of the shard. The generation wraps after
+// 2^24 (about 16 million) reuses of the same slot. An id that is older than
+// this matches again, and removes or reschedules the timeout that currently
+// uses the slot.
+const unsigned slot_bits = 32;
+const unsigned generation_bits = 24;
 
-class Timer
+inline timer_id make_id(std::size_t slot, std::uint32_t generation)
 {
-	using scoped_m = std::unique_lock<std::mutex>;
+	return (timer_id(generation & ((1u << generation_bits) - 1)) << slot_bits) | timer_id(slot);
+}
 
-	// Thread and locking variables.
-	std::mutex m;
-	std::condition_variable cond;
-	std::thread worker;
+inline std::size_t slot_of(timer_id id)
+{
+	return std::size_t(id & ((timer_id(1) << slot_bits) - 1));
+}
 
-	// Use to terminate the timer thread.
-	bool done = false;
+inline std::uint32_t generation_of(timer_id id)
+{
+	return std::uint32_t(id >> slot_bits);
+}
+
+// The id of the next event that uses the same slot.
+inline timer_id next_generation(timer_id id)
+{
+	return make_id(slot_of(id), generation_of(id) + 1);
+}
+
+// Marks an index that is not in use.
+const std::size_t npos = ~std::size_t(0);
+
+// `Allocator` rebound to `T`.
+template <class Allocator, class T>
+using rebind_alloc = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
 
-	// The vector that holds all active events.
-	std::vector<detail::Event> events;
-	// Sorted queue that has the next timeout at its top.
-	std::multiset<detail::Time_event> time_events;
+// Index of the highest set bit. `v` must not be zero.
+inline std::size_t highest_bit(std::uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return 63 - static_cast<std::size_t>(__builtin_clzll(v));
+#else
+	std::size_t n = 0;
+	while(v >>= 1) {
+		++n;
+	}
+	return n;
+#endif
+}
+
+// Index of the lowest set bit. `v` must not be zero.
+inline std::size_t lowest_bit(std::uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return static_cast<std::size_t>(__builtin_ctzll(v));
+#else
+	std::size_t n = 0;
+	while((v & 1) == 0) {
+		v >>= 1;
+		++n;
+	}
+	return n;
+#endif
+}
+
+/**
+ * Free list of memory blocks of one size.
+ *
+ * Blocks are carved from chunks that double in size and are only released when
+ * the pool is destroyed. Freed blocks are reused, so a container that keeps
+ * its size does not allocate after it has been filled once. The chunks are
+ * allocated with `Allocator`.
+ */
+template <class Allocator>
+class Node_pool
+{
+	using unit = std::max_align_t;
+	using unit_alloc = rebind_alloc<Allocator, unit>;
+	using unit_traits = std::allocator_traits<unit_alloc>;
 
-	// A list of ids to be re-used. If possible, ids are used from this pool.
-	std::stack<CppTime::timer_id> free_ids;
+	struct Block {
+		Block *next;
+	};
+
+	struct Chunk {
+		unit *data;
+		std::size_t units;
+	};
+
+	unit_alloc alloc;
+	// The size of the blocks in units. Set by the first `fits()`.
+	std::size_t block_units = 0;
+	Block *free_list = nullptr;
+	std::vector<Chunk, rebind_alloc<Allocator, Chunk>> chunks;
+	std::size_t chunk_blocks = 64;
 
 public:
-	Timer() : m{}, cond{}, worker{}, events{}, time_events{}, free_ids{}
+	explicit Node_pool(const Allocator &alloc)
+	    : alloc(alloc), chunks(rebind_alloc<Allocator, Chunk>(alloc))
 	{
-		scoped_m lock(m);
-		done = false;
-		worker = std::thread([this] { run(); });
 	}
+	Node_pool(const Node_pool &r) = delete;
+	Node_pool &operator=(const Node_pool &r) = delete;
 
-	~Timer()
+	~Node_pool()
 	{
-		scoped_m lock(m);
-		done = true;
-		lock.unlock();
-		cond.notify_all();
-		worker.join();
-		events.clear();
-		time_events.clear();
-		while(!free_ids.empty()) {
-			free_ids.pop();
+		for(const Chunk &c : chunks) {
+			unit_traits::deallocate(alloc, c.data, c.units);
 		}
 	}
 
-	/**
-	 * Add a new timer.
-	 *
-	 * \param when The time at which the handler is invoked.
-	 * \param handler The callable that is invoked when the timer fires.
-	 * \param period The periodicity at which the timer fires. Only used for periodic timers.
-	 */
-	timer_id add(
-	    const timestamp &when, handler_t &&handler, const duration &period = duration::zero())
+	// Whether an object of `size` and `align` can be taken from the pool. The
+	// first call sets the size of the blocks.
+	bool fits(std::size_t size, std::size_t align)
 	{
-		scoped_m lock(m);
-		timer_id id = 0;
-		// Add a new event. Prefer an existing and free id. If none is available, add
-		// a new one.
-		if(free_ids.empty()) {
-			id = events.size();
-			detail::Event e(id, when, period, std::move(handler));
-			events.push_back(std::move(e));
+		if(block_units == 0) {
+			block_units = (std::max(size, sizeof(Block)) + sizeof(unit) - 1) / sizeof(unit);
+		}
+		return size <= block_units * sizeof(unit) && align <= alignof(unit);
+	}
+
+	void *allocate()
+	{
+		if(free_list == nullptr) {
+			std::size_t units = block_units * chunk_blocks;
+			chunks.reserve(chunks.size() + 1);
+			unit *data = unit_traits::allocate(alloc, units);
+			chunks.push_back(Chunk{data, units});
+			for(std::size_t i = chunk_blocks; i > 0; --i) {
+				Block *b = reinterpret_cast<Block *>(data + (i - 1) * block_units);
+				b->next = free_list;
+				free_list = b;
+			}
+			chunk_blocks *= 2;
+		}
+		Block *b = free_list;
+		free_list = b->next;
+		return b;
+	}
+
+	void deallocate(void *p)
+	{
+		Block *b = static_cast<Block *>(p);
+		b->next = free_list;
+		free_list = b;
+	}
+};
+
+/**
+ * Allocator that takes single objects from a `Node_pool`, for node based
+ * containers. Arrays are allocated with `Allocator`.
+ *
+ * All copies and rebinds share the pool. The pool's block size is set by the
+ * type of the first single object that is allocated, which for a std::multiset
+ * is its node type.
+ */
+template <class T, class Allocator>
+class Pool_allocator
+{
+	template <class U, class A>
+	friend class Pool_allocator;
+
+	using array_alloc = rebind_alloc<Allocator, T>;
+	using array_traits = std::allocator_traits<array_alloc>;
+
+	std::shared_ptr<Node_pool<Allocator>> pool;
+	Allocator alloc;
+
+public:
+	using value_type = T;
+
+	explicit Pool_allocator(const Allocator &alloc)
+	    : pool(std::allocate_shared<Node_pool<Allocator>>(alloc, alloc)), alloc(alloc)
+	{
+	}
+	template <class U>
+	Pool_allocator(const Pool_allocator<U, Allocator> &r) : pool(r.pool), alloc(r.alloc)
+	{
+	}
+
+	T *allocate(std::size_t n)
+	{
+		if(n == 1 && pool->fits(sizeof(T), alignof(T))) {
+			return static_cast<T *>(pool->allocate());
+		}
+		array_alloc a(alloc);
+		return array_traits::allocate(a, n);
+	}
+
+	void deallocate(T *p, std::size_t n)
+	{
+		if(n == 1 && pool->fits(sizeof(T), alignof(T))) {
+			pool->deallocate(p);
 		} else {
-			id = free_ids.top();
-			free_ids.pop();
-			detail::Event e(id, when, period, std::move(handler));
-			events[id] = std::move(e);
+			array_alloc a(alloc);
+			array_traits::deallocate(a, p, n);
 		}
-		time_events.insert(detail::Time_event{when, id});
-		lock.unlock();
-		cond.notify_all();
-		return id;
 	}
 
-	/**
-	 * Overloaded `add` function that uses a `std::chrono::duration` instead of a
-	 * `time_point` for the first timeout.
-	 */
-	template <class Rep, class Period>
-	inline timer_id add(const std::chrono::duration<Rep, Period> &when, handler_t &&handler,
-	    const duration &period = duration::zero())
+	template <class U>
+	bool operator==(const Pool_allocator<U, Allocator> &r) const
 	{
-		return add(clock::now() + std::chrono::duration_cast<std::chrono::microseconds>(when),
-		    std::move(handler), period);
+		return pool == r.pool;
 	}
+	template <class U>
+	bool operator!=(const Pool_allocator<U, Allocator> &r) const
+	{
+		return pool != r.pool;
+	}
+};
 
-	/**
-	 * Overloaded `add` function that uses a uint64_t instead of a `time_point` for
-	 * the first timeout and the period.
-	 */
-	inline timer_id add(const uint64_t when, handler_t &&handler, const uint64_t period = 0)
+/**
+ * Queue that keeps all time events sorted in a std::multiset.
+ *
+ * Adding and removing a time event is O(log n). The position of each event in
+ * the multiset is kept by timer_id, so removing does not need to search. The
+ * nodes of the multiset are taken from a pool, so that events that are removed
+ * and added again, like periodic events, do not allocate.
+ */
+template <class Clock, class Allocator = std::allocator<char>>
+class Multiset_queue
+{
+	using time_point = typename Clock::time_point;
+	using time_event = Time_event<Clock>;
+
+	using set_t = std::multiset<time_event, std::less<time_event>,
+	    Pool_allocator<time_event, Allocator>>;
+	using iterator = typename set_t::iterator;
+
+	set_t events;
+	// Position of each event, indexed by timer_id. `events.end()` if the event
+	// is not in the queue.
+	std::vector<iterator, rebind_alloc<Allocator, iterator>> positions;
+
+public:
+	explicit Multiset_queue(const Allocator &alloc = Allocator())
+	    : events(std::less<time_event>(), Pool_allocator<time_event, Allocator>(alloc)),
+	      positions(rebind_alloc<Allocator, iterator>(alloc))
 	{
-		return add(duration(when), std::move(handler), duration(period));
 	}
 
-	/**
-	 * Removes the timer with the given id.
-	 */
-	bool remove(timer_id id)
+	void push(const time_event &te)
 	{
-		scoped_m lock(m);
-		if(events.size() == 0 || events.size() <= id) {
+		if(te.ref >= positions.size()) {
+			positions.resize(static_cast<std::size_t>(te.ref) + 1, events.end());
+		}
+		positions[te.ref] = events.insert(te);
+	}
+
+	// Add several events, with one resize of `positions`.
+	template <class It>
+	void push(It first, It last)
+	{
+		std::size_t refs = positions.size();
+		for(It it = first; it != last; ++it) {
+			refs = std::max<std::size_t>(refs, static_cast<std::size_t>(it->ref) + 1);
+		}
+		positions.resize(refs, events.end());
+		for(; first != last; ++first) {
+			positions[first->ref] = events.insert(*first);
+		}
+	}
+
+	bool erase(timer_id id)
+	{
+		if(id >= positions.size() || positions[id] == events.end()) {
 			return false;
 		}
-		events[id].valid = false;
-		events[id].handler = nullptr;
-		auto it = std::find_if(time_events.begin(), time_events.end(),
-		    [&](const detail::Time_event &te) { return te.ref == id; });
-		if(it != time_events.end()) {
-			free_ids.push(it->ref);
-			time_events.erase(it);
+		events.erase(positions[id]);
+		positions[id] = events.end();
+		return true;
+	}
+
+	bool contains(timer_id id) const
+	{
+		return id < positions.size() && positions[id] != events.end();
+	}
+
+	// Move an event in the queue to a new time. The node is reused from the pool.
+	bool update(timer_id id, const time_point &next)
+	{
+		if(!erase(id)) {
+			return false;
 		}
-		lock.unlock();
-		cond.notify_all();
+		push(time_event{next, id});
 		return true;
 	}
 
-private:
-	void run()
+	bool empty() const
 	{
-		scoped_m lock(m);
+		return events.empty();
+	}
 
-		while(!done) {
+	// The time at which the next event expires. The queue must not be empty.
+	time_point next() const
+	{
+		return events.begin()->next;
+	}
 
-			if(time_events.empty()) {
-				// Wait for work
-				cond.wait(lock);
-			} else {
-				detail::Time_event te = *time_events.begin();
-				if(CppTime::clock::now() >= te.next) {
+	// Remove the next event if it is expired at `now`.
+	bool pop_expired(const time_point &now, time_event &te)
+	{
+		if(events.empty() || events.begin()->next > now) {
+			return false;
+		}
+		te = *events.begin();
+		events.erase(events.begin());
+		positions[te.ref] = events.end();
+		return true;
+	}
+
+	void clear()
+	{
+		events.clear();
+		positions.clear();
+	}
+};
 
-					// Remove time event
-					time_events.erase(time_events.begin());
+/**
+ * Queue that keeps all time events in an indexed 4-ary min-heap.
+ *
+ * The heap is stored in one contiguous std::vector, so no memory is allocated
+ * per event and the next timeouts share a few cache lines. The heap index of
+ * each event is kept by timer_id. Adding, removing and moving an event is
+ * O(log n). Events with the same time expire in the order in which they were
+ * added.
+ */
+template <class Clock, class Allocator = std::allocator<char>>
+class Heap_queue
+{
+	using time_point = typename Clock::time_point;
+	using time_event = Time_event<Clock>;
 
-					// Invoke the handler
-					lock.unlock();
-					events[te.ref].handler(te.ref);
-					lock.lock();
+	static const std::size_t arity = 4;
 
-					if(events[te.ref].valid && events[te.ref].period.count() > 0) {
-						// The event is valid and a periodic timer.
-						te.next += events[te.ref].period;
-						time_events.insert(te);
-					} else {
-						// The event is either no longer valid because it was removed in the
-						// callback, or it is a one-shot timer.
-						events[te.ref].valid = false;
-						events[te.ref].handler = nullptr;
-						free_ids.push(te.ref);
-					}
-				} else {
-					cond.wait_until(lock, te.next);
+	struct Entry {
+		time_event te;
+		std::uint64_t seq;
+	};
+
+	std::vector<Entry, rebind_alloc<Allocator, Entry>> heap;
+	// Heap index of each event, indexed by timer_id. `npos` if the event is not
+	// in the queue.
+	std::vector<std::size_t, rebind_alloc<Allocator, std::size_t>> positions;
+	// Insertion counter, to keep the order of events with the same time.
+	std::uint64_t seq = 0;
+
+	static bool less(const Entry &l, const Entry &r)
+	{
+		return l.te.next < r.te.next || (l.te.next == r.te.next && l.seq < r.seq);
+	}
+
+	void set(std::size_t i, const Entry &e)
+	{
+		heap[i] = e;
+		positions[e.te.ref] = i;
+	}
+
+	void sift_up(std::size_t i)
+	{
+		Entry e = heap[i];
+		while(i > 0) {
+			std::size_t parent = (i - 1) / arity;
+			if(!less(e, heap[parent])) {
+				break;
+			}
+			set(i, heap[parent]);
+			i = parent;
+		}
+		set(i, e);
+	}
+
+	void sift_down(std::size_t i)
+	{
+		Entry e = heap[i];
+		std::size_t n = heap.size();
+		for(;;) {
+			std::size_t first = i * arity + 1;
+			if(first >= n) {
+				break;
+			}
+			std::size_t last = first + arity < n ? first + arity : n;
+			std::size_t best = first;
+			for(std::size_t c = first + 1; c < last; ++c) {
+				if(less(heap[c], heap[best])) {
+					best = c;
 				}
 			}
+			if(!less(heap[best], e)) {
+				break;
+			}
+			set(i, heap[best]);
+			i = best;
 		}
+		set(i, e);
 	}
-};
+
+	// Remove the entry at heap index `i`.
+	void remove_at(std::size_t i)
+	{
+		positions[heap[i].te.ref] = npos;
+		Entry last = heap.back();
+		heap.pop_back();
+		if(i < heap.size()) {
+			set(i, last);
+			if(i > 0 && less(last, heap[(i - 1) / arity])) {
+				sift_up(i);
+			} else {
+				sift_down(i);
+			}
+		}
+	}
+
+public:
+	explicit Heap_queue(const Allocator &alloc = Allocator())
+	    : heap(rebind_alloc<Allocator, Entry>(alloc)),
+	      positions(rebind_alloc<Allocator, std::size_t>(alloc))
+	{
+	}
+
+	void push(const time_event &te)
+	{
+		if(te.ref >= positions.size()) {
+			positions.resize(static_cast<std::size_t>(te.ref) + 1, npos);
+		}
+		heap.push_back(Entry{te, seq++});
+		positions[te.ref] = heap.size() - 1;
+		sift_up(heap.size() - 1);
+	}
+
+	// Add several events. If they are at least as many as the events in the
+	// queue, they are appended and the heap is rebuilt in O(n). Otherwise each
+	// one is sifted up.
+	template <class It>
+	void push(It first, It last)
+	{
+		std::size_t n = 0;
+		std::size_t refs = positions.size();
+		for(It it = first; it != last; ++it) {
+			refs = std::max<std::size_t>(refs, static_cast<std::size_t>(it->ref) + 1);
+			++n;
+		}
+		positions.resize(refs, npos);
+		heap.reserve(heap.size() + n);
+		if(n < heap.size()) {
+			for(; first != last; ++first) {
+				push(*first);
+			}
+			return;
+		}
+		for(; first != last; ++first) {
+			heap.push_back(Entry{*first, seq++});
+			positions[first->ref] = heap.size() - 1;
+		}
+		// Sift down every parent, starting with the last one.
+		for(std::size_t i = heap.size() > 1 ? (heap.size() - 2) / arity + 1 : 0; i-- > 0;) {
+			sift_down(i);
+		}
+	}
+
+	bool erase(timer_id id)
+	{
+		if(id >= positions.size() || positions[id] == npos) {
+			return false;
+		}
+		remove_at(positions[id]);
+		return true;
+	}
+
+	bool contains(timer_id id) const
+	{
+		return id < positions.size() && positions[id] != npos;
+	}
+
+	// Move an event in the queue to a new time (decrease or increase key).
+	bool update(timer_id id, const time_point &next)
+	{
+		if(id >= positions.size() || positions[id] == npos) {
+			return false;
+		}
+		std::size_t i = positions[id];
+		bool earlier = next < heap[i].te.next;
+		heap[i].te.next = next;
+		heap[i].seq = seq++;
+		if(earlier) {
+			sift_up(i);
+		} else {
+			sift_down(i);
+		}
+		return true;
+	}
+
+	bool empty() const
+	{
+		return heap.empty();
+	}
+
+	// The time at which the next event expires. The queue must not be empty.
+	time_point next() const
+	{
+		return heap.front().te.next;
+	}
+
+	// Remove the next event if it is expired at `now`.
+	bool pop_expired(const time_point &now, time_event &te)
+	{
+		if(heap.empty() || heap.front().te.next > now) {
+			return false;
+		}
+		te = heap.front().te;
+		remove_at(0);
+		return true;
+	}
+
+	void clear()
+	{
+		heap.clear();
+		positions.clear();
+	}
+};
+
+/**
+ * Queue that keeps all time events in a hierarchical timing wheel.
+ *
+ * Each level of the wheel has 256 slots. A slot on level 0 holds the events
+ * that expire in one tick. A slot on level n covers 256^n ticks, and its events
+ * are moved to the lower levels (cascaded) when the wheel reaches that slot.
+ * Adding, removing and expiring an event is O(1).
+ *
+ * The wheel spans 256^Levels ticks and has at least two levels. Events further
+ * in the future are parked on the last level and cascaded until they are in
+ * range.
+ *
+ * Expiry times are rounded up to the next tick. Events therefore never expire
+ * early, but may expire up to one tick late. The order of events that expire
+ * in the same tick is the order in which they were added.
+ */
+template <class Clock, class Tick, std::size_t Levels, class Allocator = std::allocator<char>>
+class Wheel_queue
+{
+	using time_point = typename Clock::time_point;
+	using time_event = Time_event<Clock>;
+
+	// Events beyond the range of the wheel are parked on the last level. That level
+	// must cascade, so at least two levels are needed.
+	static_assert(Levels >= 2 && Levels <= 7, "Wheel_queue supports 2 to 7 levels");
+
+	static const std::size_t slot_bits = 8;
+	static const std::size_t slots = std::size_t(1) << slot_bits;
+	static const std::size_t words = slots / 64;
+	static const std::uint64_t slot_mask = slots - 1;
+	// Index of the list that holds expired events.
+	static const std::size_t due = Levels * slots;
+
+	struct Node {
+		time_event te;
+		std::uint64_t tick;
+		std::size_t list;
+		timer_id prev;
+		timer_id next;
+	};
+
+	struct List {
+		timer_id head;
+		timer_id tail;
+	};
+
+	// Nodes are indexed by timer_id. Lists are the slots of all levels, followed
+	// by the list of expired events.
+	std::vector<Node, rebind_alloc<Allocator, Node>> nodes;
+	std::vector<List, rebind_alloc<Allocator, List>> lists;
+	std::uint64_t occupied[Levels][words];
+
+	// The next tick that has not been processed yet.
+	std::uint64_t current;
+	// The number of events in the wheel, and in the list of expired events.
+	std::size_t pending;
+	std::size_t expired;
+
+	// The tick that contains `t`.
+	static std::uint64_t floor_tick(const time_point &t)
+	{
+		auto tick = std::chrono::duration_cast<Tick>(t.time_since_epoch());
+		return tick.count() < 0 ? 0 : static_cast<std::uint64_t>(tick.count());
+	}
+
+	// The first tick that starts at or after `t`.
+	static std::uint64_t ceil_tick(const time_point &t)
+	{
+		std::uint64_t tick = floor_tick(t);
+		return from_tick(tick) < t ? tick + 1 : tick;
+	}
+
+	static time_point from_tick(std::uint64_t tick)
+	{
+		return time_point(std::chrono::duration_cast<typename Clock::duration>(
+		    Tick(static_cast<typename Tick::rep>(tick))));
+	}
+
+	void link(timer_id id, std::size_t l)
+	{
+		Node &n = nodes[id];
+		n.list = l;
+		n.prev = lists[l].tail;
+		n.next = npos;
+		if(lists[l].tail == npos) {
+			lists[l].head = id;
+		} else {
+			nodes[lists[l].tail].next = id;
+		}
+		lists[l].tail = id;
+		if(l != due) {
+			occupied[l / slots][(l % slots) / 64] |= std::uint64_t(1) << (l % 64);
+			++pending;
+		} else {
+			++expired;
+		}
+	}
+
+	void unlink(timer_id id)
+	{
+		Node &n = nodes[id];
+		std::size_t l = n.list;
+		if(n.prev == npos) {
+			lists[l].head = n.next;
+		} else {
+			nodes[n.prev].next = n.next;
+		}
+		if(n.next == npos) {
+			lists[l].tail = n.prev;
+		} else {
+			nodes[n.next].prev = n.prev;
+		}
+		n.list = npos;
+		if(l != due) {
+			if(lists[l].head == npos) {
+				occupied[l / slots][(l % slots) / 64] &= ~(std::uint64_t(1) << (l % 64));
+			}
+			--pending;
+		} else {
+			--expired;
+		}
+	}
+
+	// Put a node into the slot that matches its tick relative to `current`.
+	void place(timer_id id)
+	{
+		std::uint64_t tick = nodes[id].tick;
+		if(tick < current) {
+			tick = current;
+		}
+		std::uint64_t delta = tick - current;
+		std::size_t level = 0;
+		while(level + 1 < Levels && delta >= (std::uint64_t(1) << (slot_bits * (level + 1)))) {
+			++level;
+		}
+		std::uint64_t range = std::uint64_t(1) << (slot_bits * (level + 1));
+		if(delta >= range) {
+			// Beyond the last level. Park it at the farthest slot.
+			tick = current + range - 1;
+		}
+		std::size_t slot = (tick >> (slot_bits * level)) & slot_mask;
+		link(id, level * slots + slot);
+	}
+
+	// The first occupied slot of a level, starting at `from` and wrapping
+	// around. Returns `slots` if the level is empty.
+	std::size_t find_slot(std::size_t level, std::size_t from) const
+	{
+		for(std::size_t i = 0; i <= words; ++i) {
+			std::size_t w = (from / 64 + i) % words;
+			std::uint64_t bits = occupied[level][w];
+			if(i == 0) {
+				bits &= ~std::uint64_t(0) << (from % 64);
+			} else if(i == words) {
+				bits &= (std::uint64_t(1) << (from % 64)) - 1;
+			}
+			if(bits != 0) {
+				return w * 64 + lowest_bit(bits);
+			}
+		}
+		return slots;
+	}
+
+	// The next tick at which a slot expires (level 0) or cascades (level > 0).
+	// The wheel must not be empty.
+	std::uint64_t next_tick() const
+	{
+		std::uint64_t best = ~std::uint64_t(0);
+		for(std::size_t level = 0; level < Levels; ++level) {
+			std::size_t shift = slot_bits * level;
+			std::uint64_t low = (std::uint64_t(1) << shift) - 1;
+			std::size_t pos = (current >> shift) & slot_mask;
+			// On upper levels, the current slot has been cascaded already unless
+			// the wheel is exactly at its start.
+			std::size_t from = (level == 0 || (current & low) == 0) ? pos : (pos + 1) % slots;
+			std::size_t slot = find_slot(level, from);
+			if(slot == slots) {
+				continue;
+			}
+			std::uint64_t base = (current >> (shift + slot_bits)) << (shift + slot_bits);
+			std::uint64_t tick = base + (std::uint64_t(slot) << shift);
+			if(tick < current) {
+				tick += std::uint64_t(1) << (shift + slot_bits);
+			}
+			if(tick < best) {
+				best = tick;
+			}
+		}
+		return best;
+	}
+
+	// Move the events of the upper level slots that start at `tick` to the
+	// lower levels.
+	void cascade(std::uint64_t tick)
+	{
+		for(std::size_t level = Levels - 1; level > 0; --level) {
+			std::size_t shift = slot_bits * level;
+			if((tick & ((std::uint64_t(1) << shift) - 1)) != 0) {
+				continue;
+			}
+			std::size_t l = level * slots + ((tick >> shift) & slot_mask);
+			while(lists[l].head != npos) {
+				timer_id id = lists[l].head;
+				unlink(id);
+				place(id);
+			}
+		}
+	}
+
+	// Process all ticks up to and including `target`.
+	void advance(std::uint64_t target)
+	{
+		while(current <= target) {
+			if(pending == 0) {
+				current = target + 1;
+				break;
+			}
+			std::uint64_t tick = next_tick();
+			if(tick > target) {
+				current = target + 1;
+				break;
+			}
+			current = tick;
+			cascade(tick);
+			std::size_t l = tick & slot_mask;
+			while(lists[l].head != npos) {
+				timer_id id = lists[l].head;
+				unlink(id);
+				link(id, due);
+			}
+			++current;
+		}
+	}
+
+public:
+	explicit Wheel_queue(const Allocator &alloc = Allocator())
+	    : nodes(rebind_alloc<Allocator, Node>(alloc)),
+	      lists(due + 1, List{npos, npos}, rebind_alloc<Allocator, List>(alloc)), current(0),
+	      pending(0), expired(0)
+	{
+		std::fill(&occupied[0][0], &occupied[0][0] + Levels * words, std::uint64_t(0));
+		// Ticks before now never need to be processed.
+		current = floor_tick(Clock::now());
+	}
+
+	void push(const time_event &te)
+	{
+		if(te.ref >= nodes.size()) {
+			nodes.resize(
+			    static_cast<std::size_t>(te.ref) + 1, Node{time_event{}, 0, npos, npos, npos});
+		}
+		nodes[te.ref].te = te;
+		nodes[te.ref].tick = ceil_tick(te.next);
+		place(te.ref);
+	}
+
+	// Add several events, with one resize of `nodes`.
+	template <class It>
+	void push(It first, It last)
+	{
+		std::size_t refs = nodes.size();
+		for(It it = first; it != last; ++it) {
+			refs = std::max<std::size_t>(refs, static_cast<std::size_t>(it->ref) + 1);
+		}
+		nodes.resize(refs, Node{time_event{}, 0, npos, npos, npos});
+		for(; first != last; ++first) {
+			push(*first);
+		}
+	}
+
+	bool erase(timer_id id)
+	{
+		if(id >= nodes.size() || nodes[id].list == npos) {
+			return false;
+		}
+		unlink(id);
+		return true;
+	}
+
+	bool contains(timer_id id) const
+	{
+		return id < nodes.size() && nodes[id].list != npos;
+	}
+
+	// Move an event in the queue to a new time.
+	bool update(timer_id id, const time_point &next)
+	{
+		if(!erase(id)) {
+			return false;
+		}
+		push(time_event{next, id});
+		return true;
+	}
+
+	bool empty() const
+	{
+		return pending == 0 && expired == 0;
+	}
+
+	// The time at which the next event expires, rounded to the tick. This may
+	// also be the time at which the wheel needs to cascade. The queue must not
+	// be empty.
+	time_point next() const
+	{
+		if(expired > 0) {
+			return nodes[lists[due].head].te.next;
+		}
+		return from_tick(next_tick());
+	}
+
+	// Remove the next event if it is expired at `now`.
+	bool pop_expired(const time_point &now, time_event &te)
+	{
+		advance(floor_tick(now));
+		if(expired == 0) {
+			return false;
+		}
+		timer_id id = lists[due].head;
+		unlink(id);
+		te = nodes[id].te;
+		return true;
+	}
+
+	void clear()
+	{
+		nodes.clear();
+		std::fill(lists.begin(), lists.end(), List{npos, npos});
+		std::fill(&occupied[0][0], &occupied[0][0] + Levels * words, std::uint64_t(0));
+		pending = 0;
+		expired = 0;
+	}
+};
+
+// Flags of `Shared_event::id`, above the bits of a timer_id.
+const timer_id once_flag = timer_id(1) << 60;
+const timer_id fired_flag = timer_id(1) << 61;
+const timer_id removed_flag = timer_id(1) << 62;
+const timer_id free_flag = timer_id(1) << 63;
+
+// The part of an event that is accessed without the lock.
+//
+// `id` is the id of the event from the time it is handed out. A one-shot event
+// whose handler is about to run in a batch gets `once_flag`, which is replaced
+// by `fired_flag` when its handler starts; it can then no longer be removed.
+// Once the event is removed or has expired, `removed_flag` is added. When its
+// slot is free, it is the id of the next event in the slot with `free_flag`. A
+// slot that was never used holds 0.
+//
+// `deadline` is the soft deadline of an event that may be extended with
+// `extend()`, as a count of `Clock::duration`, or `dead` if there is none.
+//
+// `next_free` links the free slots to a lock-free stack, see `basic_timer`.
+template <class Clock>
+struct Shared_event {
+	static const typename Clock::rep dead = std::numeric_limits<typename Clock::rep>::min();
+
+	std::atomic<typename Clock::rep> deadline;
+	std::atomic<timer_id> id;
+	std::atomic<std::uint32_t> next_free;
+	Shared_event() : deadline(dead), id(0), next_free(0)
+	{
+	}
+};
+
+/**
+ * Storage for the events of a timer, indexed by slot.
+ *
+ * The slots are allocated in chunks that double in size (64, 128, 256, ...
+ * slots), and a chunk is never moved or freed until the slab is cleared. Adding
+ * events therefore never moves existing ones, and an event may be accessed
+ * without the lock while other events are added.
+ *
+ * The scheduling data (`Event`) and the handlers are kept in separate arrays,
+ * so that the data that is used when a timer fires is packed densely. A third
+ * array holds the `Shared_event`s, which are accessed without the lock.
+ */
+template <class Clock, class Handler, class Allocator = std::allocator<char>>
+class Event_slab
+{
+	static const std::size_t first_chunk_bits = 6;
+	static const std::size_t max_chunks = 32;
+
+	using hot_alloc = rebind_alloc<Allocator, Event<Clock>>;
+	using cold_alloc = rebind_alloc<Allocator, Handler>;
+	using shared_alloc = rebind_alloc<Allocator, Shared_event<Clock>>;
+
+	hot_alloc hot_a;
+	cold_alloc cold_a;
+	shared_alloc shared_a;
+	Event<Clock> *hot[max_chunks];
+	Handler *cold[max_chunks];
+	Shared_event<Clock> *shareds[max_chunks];
+	std::size_t chunks = 0;
+	// Published after the chunks, so that `size()` and the shared events can be
+	// read without the lock.
+	std::atomic<std::size_t> capacity{0};
+
+	static std::size_t chunk_of(std::size_t slot)
+	{
+		return highest_bit((std::uint64_t(slot) >> first_chunk_bits) + 1);
+	}
+
+	static std::size_t chunk_begin(std::size_t chunk)
+	{
+		return ((std::size_t(1) << chunk) - 1) << first_chunk_bits;
+	}
+
+	static std::size_t chunk_size(std::size_t chunk)
+	{
+		return std::size_t(1) << (chunk + first_chunk_bits);
+	}
+
+	template <class A>
+	static typename A::value_type *create(A &a, std::size_t n)
+	{
+		using traits = std::allocator_traits<A>;
+		typename A::value_type *p = traits::allocate(a, n);
+		for(std::size_t i = 0; i < n; ++i) {
+			traits::construct(a, p + i);
+		}
+		return p;
+	}
+
+	template <class A>
+	static void destroy(A &a, typename A::value_type *p, std::size_t n)
+	{
+		using traits = std::allocator_traits<A>;
+		for(std::size_t i = 0; i < n; ++i) {
+			traits::destroy(a, p + i);
+		}
+		traits::deallocate(a, p, n);
+	}
+
+public:
+	explicit Event_slab(const Allocator &alloc = Allocator())
+	    : hot_a(alloc), cold_a(alloc), shared_a(alloc)
+	{
+	}
+	Event_slab(const Event_slab &r) = delete;
+	Event_slab &operator=(const Event_slab &r) = delete;
+
+	~Event_slab()
+	{
+		clear();
+	}
+
+	// The number of slots that can be accessed.
+	std::size_t size() const
+	{
+		return capacity.load(std::memory_order_acquire);
+	}
+
+	// Make sure that `slot` can be accessed.
+	void grow(std::size_t slot)
+	{
+		while(slot >= size()) {
+			std::size_t n = chunk_size(chunks);
+			hot[chunks] = create(hot_a, n);
+			cold[chunks] = create(cold_a, n);
+			shareds[chunks] = create(shared_a, n);
+			++chunks;
+			capacity.fetch_add(n, std::memory_order_release);
+		}
+	}
+
+	Event<Clock> &operator[](std::size_t slot)
+	{
+		std::size_t c = chunk_of(slot);
+		return hot[c][slot - chunk_begin(c)];
+	}
+
+	Handler &handler(std::size_t slot)
+	{
+		std::size_t c = chunk_of(slot);
+		return cold[c][slot - chunk_begin(c)];
+	}
+
+	Shared_event<Clock> &shared(std::size_t slot)
+	{
+		std::size_t c = chunk_of(slot);
+		return shareds[c][slot - chunk_begin(c)];
+	}
+
+	void clear()
+	{
+		for(std::size_t c = 0; c < chunks; ++c) {
+			destroy(hot_a, hot[c], chunk_size(c));
+			destroy(cold_a, cold[c], chunk_size(c));
+			destroy(shared_a, shareds[c], chunk_size(c));
+		}
+		chunks = 0;
+		capacity.store(0);
+	}
+};
+
+/**
+ * Intrusive multi-producer single-consumer queue (after Dmitry Vyukov).
+ * Pushing is wait-free and never blocks on other producers. Only one thread
+ * may pop.
+ */
+class Mpsc_queue
+{
+public:
+	struct Node {
+		std::atomic<Node *> next{nullptr};
+	};
+
+private:
+	std::atomic<Node *> head;
+	Node *tail;
+	Node stub;
+
+public:
+	Mpsc_queue() : head(&stub), tail(&stub), stub()
+	{
+	}
+
+	Mpsc_queue(const Mpsc_queue &r) = delete;
+	Mpsc_queue &operator=(const Mpsc_queue &r) = delete;
+
+	void push(Node *n)
+	{
+		n->next.store(nullptr, std::memory_order_relaxed);
+		Node *prev = head.exchange(n);
+		prev->next.store(n, std::memory_order_release);
+	}
+
+	// Take the oldest node. May return nullptr while a producer is in the
+	// middle of a push, even if `empty()` is false.
+	Node *pop()
+	{
+		Node *t = tail;
+		Node *next = t->next.load(std::memory_order_acquire);
+		if(t == &stub) {
+			if(next == nullptr) {
+				return nullptr;
+			}
+			tail = next;
+			t = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+		if(next != nullptr) {
+			tail = next;
+			return t;
+		}
+		if(t != head.load()) {
+			return nullptr;
+		}
+		push(&stub);
+		next = t->next.load(std::memory_order_acquire);
+		if(next != nullptr) {
+			tail = next;
+			return t;
+		}
+		return nullptr;
+	}
+
+	bool empty() const
+	{
+		return head.load() == &stub;
+	}
+};
+
+// The kernel clock that matches `Clock`, or -1 if there is none.
+template <class Clock>
+struct Kernel_clock {
+	static const int id = -1;
+};
+
+// An exact reading of `Clock`. Clocks that are cheap but inexact to read, like
+// `cached_clock`, provide it as `update()`. The timer thread reads the clock
+// like this once per batch.
+template <class Clock>
+auto exact_now(int) -> decltype(Clock::update())
+{
+	return Clock::update();
+}
+
+template <class Clock>
+typename Clock::time_point exact_now(long)
+{
+	return Clock::now();
+}
+
+template <class Clock>
+typename Clock::time_point exact_now()
+{
+	return exact_now<Clock>(0);
+}
+
+// A time that is not earlier than the current time of `Clock`. Durations are
+// added to it, so that timeouts never fire early. Clocks whose `now()` may lag
+// behind, like `coarse_clock`, provide it as `ceil_now()`.
+template <class Clock>
+auto ceil_now(int) -> decltype(Clock::ceil_now())
+{
+	return Clock::ceil_now();
+}
+
+template <class Clock>
+typename Clock::time_point ceil_now(long)
+{
+	return Clock::now();
+}
+
+template <class Clock>
+typename Clock::time_point ceil_now()
+{
+	return ceil_now<Clock>(0);
+}
+
+#if defined(__linux__)
+template <>
+struct Kernel_clock<std::chrono::steady_clock> {
+	static const int id = CLOCK_MONOTONIC;
+};
+
+template <>
+struct Kernel_clock<std::chrono::system_clock> {
+	static const int id = CLOCK_REALTIME;
+};
+
+/**
+ * Lets the timer thread wait in `epoll_wait()` on a timerfd that is armed to
+ * the next deadline, and an eventfd that is written to wake it up early.
+ */
+class Kernel_wait
+{
+	int epoll_fd = -1;
+	int timer_fd = -1;
+	int event_fd = -1;
+	// Set if `epoll_wait()` failed. The descriptors stay open, so that `wake()`
+	// can still be called, but the object is no longer `valid()`.
+	std::atomic<bool> failed{false};
+
+	static void drain(int fd)
+	{
+		std::uint64_t n;
+		while(::read(fd, &n, sizeof(n)) == sizeof(n)) {
+		}
+	}
+
+	void close_all()
+	{
+		for(int fd : {epoll_fd, timer_fd, event_fd}) {
+			if(fd >= 0) {
+				::close(fd);
+			}
+		}
+		epoll_fd = timer_fd = event_fd = -1;
+	}
+
+public:
+	// Create the descriptors for a clock from `Kernel_clock`. If that fails, or
+	// `clock_id` is -1, the object is not `valid()`.
+	void open(int clock_id)
+	{
+		if(clock_id < 0) {
+			return;
+		}
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		timer_fd = timerfd_create(clock_id, TFD_NONBLOCK | TFD_CLOEXEC);
+		event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		bool ok = epoll_fd >= 0 && timer_fd >= 0 && event_fd >= 0;
+		for(int fd : {timer_fd, event_fd}) {
+			epoll_event ev = {};
+			ev.events = EPOLLIN;
+			ev.data.fd = fd;
+			ok = ok && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+		}
+		if(!ok) {
+			close_all();
+		}
+	}
+
+	Kernel_wait() = default;
+	Kernel_wait(const Kernel_wait &r) = delete;
+	Kernel_wait &operator=(const Kernel_wait &r) = delete;
+
+	~Kernel_wait()
+	{
+		close_all();
+	}
+
+	bool valid() const
+	{
+		return epoll_fd >= 0 && !failed.load();
+	}
+
+	// Arm the timerfd to an absolute time of the kernel clock, or disarm it if
+	// `until` is nullptr.
+	void arm(const std::chrono::nanoseconds *until)
+	{
+		itimerspec spec = {};
+		if(until != nullptr) {
+			// A zero time would disarm the timer.
+			std::int64_t ns = std::max<std::int64_t>(until->count(), 1);
+			spec.it_value.tv_sec = time_t(ns / 1000000000);
+			spec.it_value.tv_nsec = long(ns % 1000000000);
+		}
+		timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+	}
+
+	// Block until the timerfd expires or `wake()` is called. `epoll_wait()` is
+	// only retried if it was interrupted by a signal. On any other error, the
+	// object is no longer `valid()`, and the timer falls back to its condition
+	// variable.
+	void wait()
+	{
+		epoll_event evs[2];
+		while(epoll_wait(epoll_fd, evs, 2, -1) < 0) {
+			if(errno != EINTR) {
+				failed.store(true);
+				return;
+			}
+		}
+		clear();
+	}
+
+	// Make the descriptors unreadable until the next expiry or `wake()`.
+	void clear()
+	{
+		drain(timer_fd);
+		drain(event_fd);
+	}
+
+	// The timerfd, which is readable once the time it is armed to is reached.
+	int timer_descriptor() const
+	{
+		return timer_fd;
+	}
+
+	void wake()
+	{
+		std::uint64_t one = 1;
+		ssize_t r = ::write(event_fd, &one, sizeof(one));
+		(void)r;
+	}
+};
+#else
+class Kernel_wait
+{
+public:
+	void open(int)
+	{
+	}
+	bool valid() const
+	{
+		return false;
+	}
+	void arm(const std::chrono::nanoseconds *)
+	{
+	}
+	void wait()
+	{
+	}
+	void clear()
+	{
+	}
+	int timer_descriptor() const
+	{
+		return -1;
+	}
+	void wake()
+	{
+	}
+};
+#endif
+
+} // end namespace detail
+
+/**
+ * Queue policies. A queue policy selects the data structure that holds the
+ * time events of a `basic_timer`.
+ */
+struct multiset_queue {
+	template <class Clock, class Allocator = std::allocator<char>>
+	using queue = detail::Multiset_queue<Clock, Allocator>;
+};
+
+struct heap_queue {
+	template <class Clock, class Allocator = std::allocator<char>>
+	using queue = detail::Heap_queue<Clock, Allocator>;
+};
+
+template <class Tick = std::chrono::milliseconds, std::size_t Levels = 4>
+struct wheel_queue {
+	template <class Clock, class Allocator = std::allocator<char>>
+	using queue = detail::Wheel_queue<Clock, Tick, Levels, Allocator>;
+};
+
+/**
+ * A move-only handler that stores the callable inline, in a buffer of
+ * `Capacity` bytes. Unlike `std::function`, it never allocates memory. A
+ * callable that does not fit into the buffer is a compile-time error.
+ *
+ * ~~~
+ * using Timer = CppTime::basic_timer<CppTime::heap_queue, CppTime::clock,
+ *     CppTime::inplace_handler<64>>;
+ * ~~~
+ */
+template <std::size_t Capacity = 48>
+class inplace_handler
+{
+	struct Ops {
+		void (*invoke)(void *, timer_id);
+		// Move construct the callable from the second pointer into the first, and
+		// destroy the source.
+		void (*relocate)(void *, void *);
+		void (*destroy)(void *);
+	};
+
+	template <class F>
+	struct Ops_for {
+		static void invoke(void *p, timer_id id)
+		{
+			(*static_cast<F *>(p))(id);
+		}
+		static void relocate(void *dst, void *src)
+		{
+			new(dst) F(std::move(*static_cast<F *>(src)));
+			static_cast<F *>(src)->~F();
+		}
+		static void destroy(void *p)
+		{
+			static_cast<F *>(p)->~F();
+		}
+		static const Ops ops;
+	};
+
+	typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type storage;
+	const Ops *ops;
+
+	void reset()
+	{
+		if(ops != nullptr) {
+			ops->destroy(&storage);
+			ops = nullptr;
+		}
+	}
+
+public:
+	inplace_handler() : storage(), ops(nullptr)
+	{
+	}
+
+	inplace_handler(std::nullptr_t) : storage(), ops(nullptr)
+	{
+	}
+
+	template <class Func, class F = typename std::decay<Func>::type,
+	    class = typename std::enable_if<!std::is_same<F, inplace_handler>::value>::type>
+	inplace_handler(Func &&f) : storage(), ops(&Ops_for<F>::ops)
+	{
+		static_assert(sizeof(F) <= Capacity,
+		    "The handler does not fit into the inplace_handler. Increase the capacity.");
+		static_assert(alignof(F) <= alignof(std::max_align_t),
+		    "The handler is over-aligned for the inplace_handler.");
+		new(&storage) F(std::forward<Func>(f));
+	}
+
+	inplace_handler(inplace_handler &&r) : storage(), ops(r.ops)
+	{
+		if(ops != nullptr) {
+			ops->relocate(&storage, &r.storage);
+			r.ops = nullptr;
+		}
+	}
+
+	inplace_handler &operator=(inplace_handler &&r)
+	{
+		if(this != &r) {
+			reset();
+			if(r.ops != nullptr) {
+				r.ops->relocate(&storage, &r.storage);
+				ops = r.ops;
+				r.ops = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	inplace_handler &operator=(std::nullptr_t)
+	{
+		reset();
+		return *this;
+	}
+
+	inplace_handler(const inplace_handler &r) = delete;
+	inplace_handler &operator=(const inplace_handler &r) = delete;
+
+	~inplace_handler()
+	{
+		reset();
+	}
+
+	explicit operator bool() const
+	{
+		return ops != nullptr;
+	}
+
+	void operator()(timer_id id) const
+	{
+		ops->invoke(const_cast<void *>(static_cast<const void *>(&storage)), id);
+	}
+};
+
+template <std::size_t Capacity>
+template <class F>
+const typename inplace_handler<Capacity>::Ops inplace_handler<Capacity>::Ops_for<F>::ops = {
+    &inplace_handler<Capacity>::Ops_for<F>::invoke,
+    &inplace_handler<Capacity>::Ops_for<F>::relocate,
+    &inplace_handler<Capacity>::Ops_for<F>::destroy};
+
+/**
+ * Interface to run the handlers of expired timeouts on other threads. See
+ * `thread_pool` for an implementation. A user supplied executor must run every
+ * posted task exactly once.
+ */
+class executor
+{
+public:
+	// Runs the handler of one expired timeout. A task is small and trivially
+	// copyable, so that posting it does not need to allocate memory.
+	struct task {
+		void (*run)(void *, timer_id);
+		void *owner;
+		timer_id id;
+		void operator()() const
+		{
+			run(owner, id);
+		}
+	};
+
+	virtual ~executor() = default;
+	virtual void post(const task &t) = 0;
+};
+
+/**
+ * An executor with a fixed number of worker threads. Tasks that are still
+ * queued when the pool is destroyed are run before the threads exit.
+ */
+class thread_pool : public executor
+{
+	using scoped_m = std::unique_lock<std::mutex>;
+
+	std::mutex m;
+	std::condition_variable cond;
+	std::deque<task> tasks;
+	std::vector<std::thread> threads;
+	bool done = false;
+
+public:
+	explicit thread_pool(std::size_t n) : m{}, cond{}, tasks{}, threads{}
+	{
+		for(std::size_t i = 0; i < n; ++i) {
+			threads.emplace_back([this] { run(); });
+		}
+	}
+
+	~thread_pool()
+	{
+		scoped_m lock(m);
+		done = true;
+		lock.unlock();
+		cond.notify_all();
+		for(auto &t : threads) {
+			t.join();
+		}
+	}
+
+	void post(const task &t) override
+	{
+		scoped_m lock(m);
+		tasks.push_back(t);
+		lock.unlock();
+		cond.notify_one();
+	}
+
+private:
+	void run()
+	{
+		scoped_m lock(m);
+		for(;;) {
+			cond.wait(lock, [this] { return done || !tasks.empty(); });
+			if(tasks.empty()) {
+				return;
+			}
+			task t = tasks.front();
+			tasks.pop_front();
+			lock.unlock();
+			t();
+			lock.lock();
+		}
+	}
+};
+
+/**
+ * Options of a timer. They are selected when the timer is created.
+ */
+struct timer_options {
+	// Run the handlers with this executor instead of the timer thread. The
+	// executor must outlive the timer.
+	executor *exec = nullptr;
+
+	// Pass `add()` and `remove()` to the timer thread through a lock-free queue,
+	// instead of taking the lock of the timer. Handlers of removed timeouts are
+	// freed by the timer thread, shortly after `remove()`.
+	bool lock_free_submit = false;
+
+	// Allow timeouts to fire up to `slack` after their deadline, like the
+	// `timerslack_ns` of Linux. The timer thread then waits until the first
+	// deadline plus the slack, and fires all timeouts that have expired by then
+	// in one batch.
+	std::chrono::nanoseconds slack = std::chrono::nanoseconds::zero();
+
+	// For timeouts added with `add_precise()`, the timer thread blocks until
+	// `spin_margin` before the deadline, and then spins on the clock until the
+	// deadline. This avoids the wakeup latency of the scheduler, at the cost of
+	// one busy CPU for up to `spin_margin` per deadline.
+	std::chrono::nanoseconds spin_margin = std::chrono::nanoseconds::zero();
+
+	// On Linux, let the timer thread wait in `epoll_wait()` on a timerfd that is
+	// armed to the next deadline, and wake it up through an eventfd instead of
+	// the condition variable. Only used with the steady and the system clock.
+	bool kernel_wait = false;
+
+	// Do not start a timer thread. The owner calls `next_deadline()` and
+	// `process_expired()` instead, e.g. from its event loop. With `null_lock`,
+	// the timer is then used from one thread without any locking.
+	bool poll = false;
+
+	// In `poll` mode, keep a descriptor that becomes readable when the next
+	// timeout is due, see `basic_timer::fd()`. Linux only.
+	bool pollable = false;
+};
+
+/**
+ * A lock that spins instead of blocking. Useful if the timer is used from a
+ * few threads that only hold the lock for a very short time.
+ */
+class spin_lock
+{
+	std::atomic_flag flag = ATOMIC_FLAG_INIT;
+
+public:
+	void lock()
+	{
+		while(flag.test_and_set(std::memory_order_acquire)) {
+			std::this_thread::yield();
+		}
+	}
+
+	bool try_lock()
+	{
+		return !flag.test_and_set(std::memory_order_acquire);
+	}
+
+	void unlock()
+	{
+		flag.clear(std::memory_order_release);
+	}
+};
+
+/**
+ * A clock that only moves when it is set or advanced. It meets the
+ * requirements of `std::chrono` clocks, so a `basic_timer` in
+ * `timer_options::poll` mode can use it for tests and simulations, see
+ * `basic_timer::run_until()`. All users of the clock share the same time.
+ */
+struct manual_clock {
+	using duration = std::chrono::nanoseconds;
+	using rep = duration::rep;
+	using period = duration::period;
+	using time_point = std::chrono::time_point<manual_clock>;
+	static const bool is_steady = true;
+
+	static time_point now()
+	{
+		return time_point(duration(current().load()));
+	}
+
+	static void set(const time_point &t)
+	{
+		current().store(t.time_since_epoch().count());
+	}
+
+	static void advance(const duration &d)
+	{
+		current().fetch_add(d.count());
+	}
+
+private:
+	static std::atomic<rep> &current()
+	{
+		static std::atomic<rep> t{0};
+		return t;
+	}
+};
+
+/**
+ * A clock that reads `CLOCK_MONOTONIC_COARSE` on Linux, which does not need a
+ * system call but only advances once per scheduler tick (1 to 4 ms). Its
+ * `update()` reads `CLOCK_MONOTONIC`, which has the same epoch, so that the
+ * timer thread still fires the timeouts on time. Timeouts that are added with a
+ * duration start from `ceil_now()`, the coarse time rounded up by its
+ * resolution, so they may fire a few ms late, but never early. On other
+ * systems, all of them read `std::chrono::steady_clock`.
+ */
+struct coarse_clock {
+	using duration = std::chrono::nanoseconds;
+	using rep = duration::rep;
+	using period = duration::period;
+	using time_point = std::chrono::time_point<coarse_clock>;
+	static const bool is_steady = true;
+
+	static time_point now()
+	{
+#if defined(__linux__) && defined(CLOCK_MONOTONIC_COARSE)
+		return read(CLOCK_MONOTONIC_COARSE);
+#else
+		return update();
+#endif
+	}
+
+	static time_point update()
+	{
+#if defined(__linux__)
+		return read(CLOCK_MONOTONIC);
+#else
+		return time_point(std::chrono::duration_cast<duration>(
+		    std::chrono::steady_clock::now().time_since_epoch()));
+#endif
+	}
+
+	// The coarse time rounded up, which is not earlier than the current time.
+	// The kernel may store the coarse time of a tick only at the next one, so
+	// it can lag behind by up to twice its resolution.
+	static time_point ceil_now()
+	{
+#if defined(__linux__) && defined(CLOCK_MONOTONIC_COARSE)
+		static const duration resolution = read_resolution();
+		return now() + 2 * resolution;
+#else
+		return now();
+#endif
+	}
+
+private:
+#if defined(__linux__)
+	static time_point read(clockid_t id)
+	{
+		timespec ts;
+		clock_gettime(id, &ts);
+		return time_point(std::chrono::seconds(ts.tv_sec) + duration(ts.tv_nsec));
+	}
+#endif
+
+#if defined(__linux__) && defined(CLOCK_MONOTONIC_COARSE)
+	static duration read_resolution()
+	{
+		timespec ts;
+		if(clock_getres(CLOCK_MONOTONIC_COARSE, &ts) != 0) {
+			// A scheduler tick is at most 10 ms (100 Hz).
+			return std::chrono::milliseconds(10);
+		}
+		return std::chrono::seconds(ts.tv_sec) + duration(ts.tv_nsec);
+	}
+#endif
+};
+
+/**
+ * A clock that reads the time stamp counter of the CPU and converts it to
+ * nanoseconds. The conversion is calibrated against `std::chrono::steady_clock`
+ * during 10 ms on the first call, and the clock starts at the time of
+ * `steady_clock` then. Needs an invariant TSC that is synchronized between the
+ * CPUs, which most current x86 CPUs have. Because the clock slowly drifts away
+ * from `steady_clock`, a timer on this clock does not use `kernel_wait`. On
+ * other CPUs and compilers, reads `steady_clock`.
+ */
+struct tsc_clock {
+	using duration = std::chrono::nanoseconds;
+	using rep = duration::rep;
+	using period = duration::period;
+	using time_point = std::chrono::time_point<tsc_clock>;
+	static const bool is_steady = true;
+
+	static time_point now()
+	{
+#if defined(CPPTIME_HAS_TSC)
+		const calibration &c = calibrated();
+		__extension__ unsigned __int128 ticks = __rdtsc() - c.tsc;
+		return time_point(duration(c.base + rep((ticks * c.mult) >> 32)));
+#else
+		return time_point(std::chrono::duration_cast<duration>(
+		    std::chrono::steady_clock::now().time_since_epoch()));
+#endif
+	}
+
+#if defined(CPPTIME_HAS_TSC)
+private:
+	struct calibration {
+		std::uint64_t tsc;
+		rep base;
+		// Nanoseconds per tick, as a fixed point number with 32 fraction bits.
+		std::uint64_t mult;
+	};
+
+	static const calibration &calibrated()
+	{
+		static const calibration c = calibrate();
+		return c;
+	}
+
+	static calibration calibrate()
+	{
+		using std::chrono::steady_clock;
+		steady_clock::time_point start = steady_clock::now();
+		std::uint64_t tsc_start = __rdtsc();
+		steady_clock::time_point end;
+		do {
+			end = steady_clock::now();
+		} while(end - start < std::chrono::milliseconds(10));
+		std::uint64_t tsc_end = __rdtsc();
+		std::uint64_t ns =
+		    std::uint64_t(std::chrono::duration_cast<duration>(end - start).count());
+		return calibration{tsc_end,
+		    std::chrono::duration_cast<duration>(end.time_since_epoch()).count(),
+		    (ns << 32) / (tsc_end - tsc_start)};
+	}
+#endif
+};
+
+/**
+ * A clock whose `now()` only loads a time that is stored by `update()`. The
+ * timer thread calls `update()` once per batch of expired timeouts, so that
+ * handlers read the clock without any cost, with the time of the batch.
+ * Between batches, the time stands still unless a `clock_ticker` updates it.
+ * Timeouts that are added with a duration are therefore measured from
+ * `ceil_now()`, which reads `Source`, so that they never fire early. `Source`
+ * may itself be e.g. `coarse_clock` or `tsc_clock`, which are cheap to read.
+ * All users of the clock share the same time.
+ */
+template <class Source = std::chrono::steady_clock>
+struct cached_clock {
+	using duration = typename Source::duration;
+	using rep = typename Source::rep;
+	using period = typename Source::period;
+	using time_point = std::chrono::time_point<cached_clock>;
+	static const bool is_steady = Source::is_steady;
+
+	static time_point now()
+	{
+		return time_point(duration(current().load(std::memory_order_relaxed)));
+	}
+
+	// Store the current time of `Source`. The stored time never goes back, even
+	// if several threads update it.
+	static time_point update()
+	{
+		rep t = detail::exact_now<Source>().time_since_epoch().count();
+		std::atomic<rep> &c = current();
+		rep old = c.load(std::memory_order_relaxed);
+		while(old < t && !c.compare_exchange_weak(old, t, std::memory_order_relaxed)) {
+		}
+		return time_point(duration(std::max(old, t)));
+	}
+
+	// The current time of `Source`, not the stored one.
+	static time_point ceil_now()
+	{
+		return time_point(detail::ceil_now<Source>().time_since_epoch());
+	}
+
+private:
+	static std::atomic<rep> &current()
+	{
+		static std::atomic<rep> t{Source::now().time_since_epoch().count()};
+		return t;
+	}
+};
+
+/**
+ * Keeps the time of a `cached_clock` fresh between the batches of the timer,
+ * by calling `Clock::update()` every `interval` from a thread of its own.
+ */
+template <class Clock>
+class clock_ticker
+{
+	std::mutex m;
+	std::condition_variable cond;
+	bool done = false;
+	std::thread worker;
+
+public:
+	explicit clock_ticker(std::chrono::nanoseconds interval = std::chrono::milliseconds(1))
+	{
+		worker = std::thread([this, interval]() {
+			std::unique_lock<std::mutex> lock(m);
+			while(!done) {
+				Clock::update();
+				cond.wait_for(lock, interval);
+			}
+		});
+	}
+
+	~clock_ticker()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m);
+			done = true;
+		}
+		cond.notify_all();
+		worker.join();
+	}
+
+	clock_ticker(const clock_ticker &) = delete;
+	clock_ticker &operator=(const clock_ticker &) = delete;
+};
+
+namespace detail
+{
+
+#if defined(__linux__)
+template <>
+struct Kernel_clock<coarse_clock> {
+	static const int id = CLOCK_MONOTONIC;
+};
+#endif
+
+template <class Source>
+struct Kernel_clock<cached_clock<Source>> : Kernel_clock<Source> {
+};
+
+} // end namespace detail
+
+/**
+ * A lock that does nothing. Only for timers in `timer_options::poll` mode that
+ * are used from a single thread.
+ */
+struct null_lock {
+	void lock()
+	{
+	}
+
+	bool try_lock()
+	{
+		return true;
+	}
+
+	void unlock()
+	{
+	}
+};
+
+/**
+ * The timer. The template parameters select the policies of the timer:
+ *
+ * - `QueuePolicy` is the data structure that holds the time events, e.g.
+ *   `multiset_queue`, `heap_queue` or `wheel_queue`.
+ * - `Clock` is a clock that meets the requirements of `std::chrono` clocks.
+ * - `Handler` is the type of the callable that is invoked when a timer fires.
+ *   It must be default constructible, movable and callable with a `timer_id`.
+ * - `Lock` is the mutex that protects the timer, e.g. `std::mutex` or
+ *   `spin_lock`.
+ * - `Allocator` provides the memory of the events, the queue and the other
+ *   internal containers. It is rebound to the types it allocates, and must be
+ *   thread-safe if `lock_free_submit` is used. The handlers are stored in the
+ *   events, so an `inplace_handler` also lives in this memory, while a
+ *   `std::function` allocates large callables itself.
+ */
+template <class QueuePolicy, class Clock = CppTime::clock, class Handler = handler_t,
+    class Lock = std::mutex, class Allocator = std::allocator<char>>
+class basic_timer
+{
+public:
+	using clock_type = Clock;
+	using time_point = typename Clock::time_point;
+	using handler_type = Handler;
+	using lock_type = Lock;
+	using allocator_type = Allocator;
+
+private:
+	using scoped_m = std::unique_lock<Lock>;
+	using condition_type = typename std::conditional<std::is_same<Lock, std::mutex>::value,
+	    std::condition_variable, std::condition_variable_any>::type;
+	using event_type = detail::Event<Clock>;
+	using time_event = detail::Time_event<Clock>;
+	using queue_type = typename QueuePolicy::template queue<Clock, Allocator>;
+
+	// Thread and locking variables.
+	Lock m;
+	condition_type cond;
+	std::thread worker;
+
+	// Use to terminate the timer thread.
+	bool done = false;
+
+	// The slab that holds all active events.
+	detail::Event_slab<Clock, Handler, Allocator> events;
+	// Queue that has the next timeout at its top.
+	queue_type time_events;
+	// The events added with `add_precise()`. They are kept apart, so that the
+	// timer thread knows when it has to spin.
+	queue_type precise_events;
+
+	// The free slots, which are used before new ones, as a lock-free stack
+	// (Treiber). The lower 32 bits are the top slot + 1, or 0 if the stack is
+	// empty. The upper 32 bits count the changes, so that a slot that is popped
+	// and pushed again in between does not confuse a pop (ABA).
+	std::atomic<std::uint64_t> free_slots{0};
+
+	// The events that expired in the current batch. Only used by the timer thread.
+	std::vector<time_event, detail::rebind_alloc<Allocator, time_event>> expired;
+	// The handlers of `expired` while they run.
+	std::vector<Handler, detail::rebind_alloc<Allocator, Handler>> batch;
+
+	// If set, handlers are run by this executor instead of the timer thread.
+	executor *exec;
+	// The number of handlers posted to the executor that have not finished yet.
+	std::size_t in_flight = 0;
+
+	// A command that is passed to the timer thread if `submit` is set.
+	struct Command : detail::Mpsc_queue::Node {
+		timer_id id;
+		time_point when;
+		duration period;
+		Handler handler;
+		bool cancel;
+		Command(timer_id id, time_point when, duration period, Handler &&handler, bool cancel)
+		    : id(id), when(when), period(period), handler(std::move(handler)), cancel(cancel)
+		{
+		}
+	};
+
+	// Set if `add()` and `remove()` are submitted through `commands`.
+	bool submit;
+	detail::Mpsc_queue commands;
+	detail::rebind_alloc<Allocator, Command> command_alloc;
+	// The number of slots that have been handed out.
+	std::atomic<std::size_t> slot_count{0};
+	// The deadline the timer thread waits for, as a count of `Clock::duration`.
+	// The minimum while the timer thread is awake, the maximum if it waits
+	// without a deadline. The timer thread only needs to be woken up for an
+	// earlier deadline.
+	std::atomic<typename Clock::rep> head;
+
+	// Counters for `stats()`.
+	std::atomic<std::uint64_t> wakeups{0};
+	std::atomic<std::uint64_t> notifications{0};
+	std::atomic<std::uint64_t> fired{0};
+	std::atomic<typename Clock::rep> lateness{0};
+	std::atomic<typename Clock::rep> max_lateness{0};
+
+	// Set up if `timer_options::kernel_wait` or `pollable` is set.
+	detail::Kernel_wait kernel;
+	// Set if the timerfd of `kernel` is kept armed to the next deadline for the
+	// owner of a timer in poll mode. `head` is then the armed deadline.
+	bool pollable;
+
+	// See `timer_options`.
+	typename Clock::duration slack;
+	typename Clock::duration spin_margin;
+
+	Allocator alloc;
+
+public:
+	basic_timer() : basic_timer(timer_options())
+	{
+	}
+
+	/**
+	 * Create a timer that runs the handlers with the given executor. The timer
+	 * thread then only manages the timeouts. The executor must outlive the timer.
+	 *
+	 * A periodic timeout is renewed when its handler has finished, so its
+	 * handler never runs concurrently with itself.
+	 */
+	explicit basic_timer(executor &ex) : basic_timer(with_executor(ex))
+	{
+	}
+
+	/**
+	 * Create a timer whose internal memory is allocated with `alloc`.
+	 */
+	explicit basic_timer(const Allocator &alloc) : basic_timer(timer_options(), alloc)
+	{
+	}
+
+	explicit basic_timer(const timer_options &opts, const Allocator &alloc = Allocator())
+	    : m{}, cond{}, worker{}, events(alloc), time_events(alloc), precise_events(alloc),
+	      expired(detail::rebind_alloc<Allocator, time_event>(alloc)),
+	      batch(detail::rebind_alloc<Allocator, Handler>(alloc)), exec(opts.exec),
+	      submit(opts.lock_free_submit), commands{},
+	      command_alloc(detail::rebind_alloc<Allocator, Command>(alloc)),
+	      head(std::numeric_limits<typename Clock::rep>::min()),
+	      slack(std::chrono::duration_cast<typename Clock::duration>(opts.slack)),
+	      spin_margin(std::chrono::duration_cast<typename Clock::duration>(opts.spin_margin)),
+	      alloc(alloc)
+	{
+		if(opts.kernel_wait || (opts.poll && opts.pollable)) {
+			kernel.open(detail::Kernel_clock<Clock>::id);
+		}
+		pollable = opts.poll && opts.pollable && kernel.valid();
+		if(pollable) {
+			head.store(std::numeric_limits<typename Clock::rep>::max());
+		}
+		if(!opts.poll) {
+			scoped_m lock(m);
+			done = false;
+			worker = std::thread([this] { run(); });
+		}
+	}
+
+	~basic_timer()
+	{
+		scoped_m lock(m);
+		done = true;
+		lock.unlock();
+		wake_worker();
+		if(worker.joinable()) {
+			worker.join();
+		}
+		lock.lock();
+		cond.wait(lock, [this] { return in_flight == 0; });
+		apply_commands();
+		lock.unlock();
+		events.clear();
+		time_events.clear();
+		precise_events.clear();
+		free_slots.store(0);
+	}
+
+	/**
+	 * Add a new timer.
+	 *
+	 * \param when The time at which the handler is invoked.
+	 * \param handler The callable that is invoked when the timer fires.
+	 * \param period The periodicity at which the timer fires. Only used for periodic timers.
+	 */
+	timer_id add(
+	    const time_point &when, Handler &&handler, const duration &period = duration::zero())
+	{
+		if(submit) {
+			timer_id id = acquire_id();
+			commands.push(new_command(id, when, period, std::move(handler), false));
+			if(pollable) {
+				if(earlier_than_head(when)) {
+					scoped_m lock(m);
+					claim_wakeup(when);
+				}
+			} else if(claim_submitted_wakeup(when)) {
+				if(!kernel.valid()) {
+					// The timer thread may have checked for commands and not yet
+					// waited on the condition variable. It holds the lock in between.
+					scoped_m lock(m);
+				}
+				notify();
+			}
+			return id;
+		}
+
+		timer_id id = acquire_id();
+		scoped_m lock(m);
+		insert(id, when, period, std::move(handler));
+		bool wake = claim_wakeup(when);
+		lock.unlock();
+		if(wake) {
+			notify();
+		}
+		return id;
+	}
+
+	/**
+	 * Overloaded `add` function that uses a `std::chrono::duration` instead of a
+	 * `time_point` for the first timeout.
+	 */
+	template <class Rep, class Period>
+	inline timer_id add(const std::chrono::duration<Rep, Period> &when, Handler &&handler,
+	    const duration &period = duration::zero())
+	{
+		return add(
+		    detail::ceil_now<Clock>() + std::chrono::duration_cast<typename Clock::duration>(when),
+		    std::move(handler), period);
+	}
+
+	/**
+	 * Overloaded `add` function that uses a uint64_t instead of a `time_point` for
+	 * the first timeout and the period.
+	 */
+	inline timer_id add(const uint64_t when, Handler &&handler, const uint64_t period = 0)
+	{
+		return add(duration(when), std::move(handler), duration(period));
+	}
+
+	/**
+	 * A timeout for `add_bulk()`.
+	 */
+	struct bulk_timeout {
+		time_point when;
+		Handler handler;
+		duration period;
+
+		bulk_timeout(const time_point &when, Handler &&handler,
+		    const duration &period = duration::zero())
+		    : when(when), handler(std::move(handler)), period(period)
+		{
+		}
+	};
+
+	/**
+	 * Add all `bulk_timeout`s of a range, e.g. a std::vector, and move their
+	 * handlers into the timer. Returns their ids in the same order. The lock is
+	 * taken once, the memory for all timeouts is reserved up front, and the
+	 * timer thread is woken up at most once.
+	 */
+	template <class Range>
+	std::vector<timer_id> add_bulk(Range &&timeouts)
+	{
+		std::vector<timer_id> ids(
+		    std::size_t(std::distance(std::begin(timeouts), std::end(timeouts))));
+		if(ids.empty()) {
+			return ids;
+		}
+		for(timer_id &id : ids) {
+			id = acquire_id();
+		}
+		scoped_m lock(m);
+		std::vector<time_event, detail::rebind_alloc<Allocator, time_event>> added{
+		    detail::rebind_alloc<Allocator, time_event>(alloc)};
+		added.reserve(ids.size());
+		time_point earliest = time_point::max();
+		auto id = ids.begin();
+		for(auto &t : timeouts) {
+			std::size_t slot = detail::slot_of(*id);
+			events[slot] = event_type(*id, t.when, t.period, false, false);
+			events.handler(slot) = std::move(t.handler);
+			added.push_back(time_event{t.when, slot});
+			earliest = std::min(earliest, t.when);
+			++id;
+		}
+		time_events.push(added.begin(), added.end());
+
+		bool wake = claim_wakeup(earliest);
+		lock.unlock();
+		if(wake) {
+			notify();
+		}
+		return ids;
+	}
+
+	/**
+	 * Add a one-shot timer with a soft deadline. The deadline can be extended
+	 * with `extend()`, e.g. for idle timeouts that are extended on every packet.
+	 * The queue entry is only moved when it reaches an outdated deadline.
+	 */
+	timer_id add_soft(const time_point &when, Handler &&handler)
+	{
+		return add_direct(when, std::move(handler), duration::zero(), true, false);
+	}
+
+	template <class Rep, class Period>
+	timer_id add_soft(const std::chrono::duration<Rep, Period> &when, Handler &&handler)
+	{
+		return add_soft(
+		    detail::ceil_now<Clock>() + std::chrono::duration_cast<typename Clock::duration>(when),
+		    std::move(handler));
+	}
+
+	/**
+	 * Add a timer that fires as close to its deadline as possible. The timer
+	 * thread spins for `timer_options::spin_margin` before its deadline, see
+	 * there. Timeouts of other timers are not affected. The accuracy is limited
+	 * by the resolution of the queue, e.g. the tick of a `wheel_queue`.
+	 */
+	timer_id add_precise(
+	    const time_point &when, Handler &&handler, const duration &period = duration::zero())
+	{
+		return add_direct(when, std::move(handler), period, false, true);
+	}
+
+	template <class Rep, class Period>
+	timer_id add_precise(const std::chrono::duration<Rep, Period> &when, Handler &&handler,
+	    const duration &period = duration::zero())
+	{
+		return add_precise(
+		    detail::ceil_now<Clock>() + std::chrono::duration_cast<typename Clock::duration>(when),
+		    std::move(handler), period);
+	}
+
+	/**
+	 * Extend the soft deadline of a timer added with `add_soft()` to `when`. An
+	 * earlier `when` leaves the deadline unchanged. Returns false if the id is
+	 * unknown, or if the timer has already expired or been removed.
+	 */
+	bool extend(timer_id id, const time_point &when)
+	{
+		// The lock keeps the slot from being freed and reused while the deadline
+		// is stored. Without it, a compare-exchange on the deadline alone could
+		// extend a new timer in the slot that happens to have the same deadline.
+		scoped_m lock(m);
+		std::size_t slot = detail::slot_of(id);
+		if(slot >= events.size() || events.shared(slot).id.load() != id ||
+		    !events[slot].soft) {
+			return false;
+		}
+		std::atomic<typename Clock::rep> &deadline = events.shared(slot).deadline;
+		typename Clock::rep w = when.time_since_epoch().count();
+		if(w > deadline.load()) {
+			deadline.store(w);
+		}
+		return true;
+	}
+
+	template <class Rep, class Period>
+	bool extend(timer_id id, const std::chrono::duration<Rep, Period> &when)
+	{
+		return extend(id,
+		    detail::ceil_now<Clock>() + std::chrono::duration_cast<typename Clock::duration>(when));
+	}
+
+	/**
+	 * Removes the timer with the given id. Returns false if the id is unknown,
+	 * or if the timer has already been removed or expired. A one-shot timer has
+	 * expired as soon as its handler has started, also while it still runs. In
+	 * lock-free submission mode, the timer is marked as removed without the
+	 * lock, and removed from the queue later by the timer thread. An id that is
+	 * older than 2^24 reuses of its slot matches again, see `detail::make_id()`.
+	 */
+	bool remove(timer_id id)
+	{
+		if(submit) {
+			if(!mark_removed(id)) {
+				return false;
+			}
+			commands.push(new_command(id, time_point(), duration::zero(), Handler(), true));
+			return true;
+		}
+
+		// The timer thread is not woken up. If the removed timeout was the next
+		// one, the timer thread wakes up at its deadline and finds nothing to do.
+		scoped_m lock(m);
+		return cancel(id);
+	}
+
+	/**
+	 * Remove all timers whose ids are in the range `ids`, under one lock.
+	 * Returns the number of removed timers, see `remove()`.
+	 */
+	template <class Range>
+	std::size_t remove_bulk(const Range &ids)
+	{
+		std::size_t n = 0;
+		if(submit) {
+			for(timer_id id : ids) {
+				n += remove(id) ? 1 : 0;
+			}
+			return n;
+		}
+		scoped_m lock(m);
+		for(timer_id id : ids) {
+			n += cancel(id) ? 1 : 0;
+		}
+		return n;
+	}
+
+	/**
+	 * Move the next timeout of a timer to `when`, keeping its id and handler.
+	 * Returns false if the id is unknown, or if the timer has already expired
+	 * (one-shot) or been removed. If called while the handler runs, the timer is
+	 * renewed at `when` after the handler.
+	 *
+	 * A later deadline is only stored in the event. The queue entry is moved when
+	 * it reaches the old deadline, so that postponing a timer many times, e.g.
+	 * an idle timeout, costs one queue operation in total.
+	 */
+	bool reschedule(timer_id id, const time_point &when)
+	{
+		return rearm(id, when, nullptr);
+	}
+
+	/**
+	 * Like `reschedule(id, when)`, and set the period of the timer to `period`.
+	 */
+	bool reschedule(timer_id id, const time_point &when, const duration &period)
+	{
+		return rearm(id, when, &period);
+	}
+
+	template <class Rep, class Period>
+	bool reschedule(timer_id id, const std::chrono::duration<Rep, Period> &when)
+	{
+		return reschedule(id,
+		    detail::ceil_now<Clock>() + std::chrono::duration_cast<typename Clock::duration>(when));
+	}
+
+	template <class Rep, class Period>
+	bool reschedule(
+	    timer_id id, const std::chrono::duration<Rep, Period> &when, const duration &period)
+	{
+		return reschedule(id,
+		    detail::ceil_now<Clock>() + std::chrono::duration_cast<typename Clock::duration>(when),
+		    period);
+	}
+
+	/**
+	 * The time at which `process_expired()` needs to be called next, including
+	 * the slack, or `time_point::max()` if no timeout is pending. For timers in
+	 * `timer_options::poll` mode.
+	 */
+	time_point next_deadline()
+	{
+		scoped_m lock(m);
+		if(submit) {
+			apply_commands();
+		}
+		return next_wake();
+	}
+
+	/**
+	 * Run the handlers of all timeouts that have expired at `now` on the calling
+	 * thread, or hand them to the executor. Returns the number of expired
+	 * timeouts. For timers in `timer_options::poll` mode, which have no timer
+	 * thread that could do this concurrently.
+	 */
+	std::size_t process_expired(const time_point &now = detail::exact_now<Clock>())
+	{
+		scoped_m lock(m);
+		if(submit) {
+			apply_commands();
+		}
+		std::size_t n = dispatch(lock, now);
+		if(pollable) {
+			arm_descriptor();
+		}
+		return n;
+	}
+
+	/**
+	 * Advance the clock by `d` and run all timeouts that expire on the way, see
+	 * `run_until()`.
+	 */
+	template <class Rep, class Period>
+	std::size_t advance(const std::chrono::duration<Rep, Period> &d)
+	{
+		return run_until(Clock::now() + std::chrono::duration_cast<typename Clock::duration>(d));
+	}
+
+	/**
+	 * Run all timeouts up to `target` in order on the calling thread, without
+	 * waiting. The clock is set to each deadline before its handlers run, and to
+	 * `target` at the end. Returns the number of expired timeouts. For timers in
+	 * `timer_options::poll` mode with a clock that can be set, like
+	 * `manual_clock`, e.g. in a discrete-event simulation.
+	 */
+	std::size_t run_until(const time_point &target)
+	{
+		std::size_t n = step_until(target);
+		if(Clock::now() < target) {
+			Clock::set(target);
+		}
+		return n;
+	}
+
+	/**
+	 * Like `run_until()`, but runs until no timeout is left. The clock stays at
+	 * the last deadline. Does not return while periodic timeouts are left.
+	 */
+	std::size_t run_until_empty()
+	{
+		return step_until(time_point::max());
+	}
+
+	/**
+	 * A descriptor that becomes readable when the next timeout is due, for timers
+	 * in `timer_options::poll` mode with `pollable` set. Wait for it together
+	 * with other descriptors, e.g. with epoll, and call `dispatch_ready()` when
+	 * it is readable. -1 if not available.
+	 */
+	int fd() const
+	{
+		return pollable ? kernel.timer_descriptor() : -1;
+	}
+
+	/**
+	 * Run the handlers of all expired timeouts and re-arm `fd()` to the next
+	 * deadline. Returns the number of expired timeouts.
+	 */
+	std::size_t dispatch_ready()
+	{
+		kernel.clear();
+		return process_expired(detail::exact_now<Clock>());
+	}
+
+	/**
+	 * Statistics about the wakeups of the timer thread.
+	 */
+	struct stats_type {
+		// The number of times the timer thread woke up from a wait.
+		std::uint64_t wakeups;
+		// The number of times `add()` or a finished handler woke up the timer
+		// thread, because the new deadline was earlier than the one it waited for.
+		std::uint64_t notifications;
+		// The number of expired timeouts, and the sum and maximum of the time by
+		// which they were taken from the queue after their deadline.
+		std::uint64_t fired;
+		typename Clock::duration lateness;
+		typename Clock::duration max_lateness;
+	};
+
+	stats_type stats() const
+	{
+		return stats_type{wakeups.load(std::memory_order_relaxed),
+		    notifications.load(std::memory_order_relaxed), fired.load(std::memory_order_relaxed),
+		    typename Clock::duration(lateness.load(std::memory_order_relaxed)),
+		    typename Clock::duration(max_lateness.load(std::memory_order_relaxed))};
+	}
+
+	/**
+	 * The native handle of the timer thread, e.g. to set its CPU affinity.
+	 */
+	std::thread::native_handle_type native_handle()
+	{
+		return worker.native_handle();
+	}
+
+	allocator_type get_allocator() const
+	{
+		return alloc;
+	}
+
+private:
+	static timer_options with_executor(executor &ex)
+	{
+		timer_options opts;
+		opts.exec = &ex;
+		return opts;
+	}
+
+	// Take a free id. Prefer a free slot from `free_slots`. If none is
+	// available, use a new one, and grow the slab under the lock if needed. The
+	// id is published in the shared event of its slot before it is returned, so
+	// that `remove()` can mark it as removed before the event is inserted. Must
+	// be called without the lock.
+	timer_id acquire_id()
+	{
+		std::uint64_t head = free_slots.load(std::memory_order_acquire);
+		while(std::uint32_t top = std::uint32_t(head)) {
+			detail::Shared_event<Clock> &shared = events.shared(top - 1);
+			std::uint64_t next = (((head >> 32) + 1) << 32) | shared.next_free.load();
+			if(free_slots.compare_exchange_weak(head, next, std::memory_order_acquire)) {
+				timer_id id = shared.id.load() & ~detail::free_flag;
+				shared.id.store(id);
+				return id;
+			}
+		}
+		std::size_t slot = slot_count++;
+		if(slot >= events.size()) {
+			scoped_m lock(m);
+			events.grow(slot);
+		}
+		timer_id id = detail::make_id(slot, 0);
+		events.shared(slot).id.store(id);
+		return id;
+	}
+
+	// Free the slot of an event and push it to `free_slots`. The next event in
+	// this slot gets a new generation, so the old id can no longer be used. Must
+	// be called with the lock held.
+	void release_id(std::size_t slot)
+	{
+		retire_soft(slot);
+		detail::Shared_event<Clock> &shared = events.shared(slot);
+		shared.id.store(detail::next_generation(events[slot].id) | detail::free_flag);
+		std::uint64_t head = free_slots.load(std::memory_order_relaxed);
+		std::uint64_t next;
+		do {
+			shared.next_free.store(std::uint32_t(head));
+			next = (((head >> 32) + 1) << 32) | std::uint64_t(slot + 1);
+		} while(!free_slots.compare_exchange_weak(head, next, std::memory_order_release,
+		    std::memory_order_relaxed));
+	}
+
+	// Mark an event as removed without the lock. Returns true only for the id
+	// that is currently published in its slot, see `acquire_id()`, and only
+	// once. Returns false if the id was never handed out, is stale, or the event
+	// was already removed or has fired.
+	bool mark_removed(timer_id id)
+	{
+		std::size_t slot = detail::slot_of(id);
+		if(slot >= slot_count.load() || slot >= events.size()) {
+			return false;
+		}
+		std::atomic<timer_id> &shared = events.shared(slot).id;
+		timer_id current = shared.load();
+		while(current == id || current == (id | detail::once_flag)) {
+			if(shared.compare_exchange_weak(current, id | detail::removed_flag)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Add an event under the lock, also in lock-free submission mode, so that it
+	// can be used right away.
+	timer_id add_direct(const time_point &when, Handler &&handler, const duration &period,
+	    bool soft, bool precise)
+	{
+		timer_id id = acquire_id();
+		scoped_m lock(m);
+		insert(id, when, period, std::move(handler), soft, precise);
+		bool wake = claim_wakeup(when, precise);
+		lock.unlock();
+		if(wake) {
+			notify();
+		}
+		return id;
+	}
+
+	// Add a new event. Must be called with the lock held.
+	void insert(timer_id id, const time_point &when, const duration &period, Handler &&handler,
+	    bool soft = false, bool precise = false)
+	{
+		std::size_t slot = detail::slot_of(id);
+		events[slot] = event_type(id, when, period, soft, precise);
+		events.handler(slot) = std::move(handler);
+		if(soft) {
+			events.shared(slot).deadline.store(when.time_since_epoch().count());
+		}
+		queue_of(slot).push(time_event{when, slot});
+	}
+
+	// The queue that holds an event.
+	queue_type &queue_of(std::size_t slot)
+	{
+		return events[slot].precise ? precise_events : time_events;
+	}
+
+	// Stop `extend()` for an event. Must be called with the lock held.
+	void retire_soft(std::size_t slot)
+	{
+		if(events[slot].soft) {
+			events[slot].soft = false;
+			events.shared(slot).deadline.store(detail::Shared_event<Clock>::dead);
+		}
+	}
+
+	// Mark a one-shot event whose handler is about to run, see `claim()`. Must be
+	// called with the lock held.
+	void mark_once(std::size_t slot)
+	{
+		event_type &ev = events[slot];
+		timer_id id = ev.id;
+		if(ev.period.count() == 0 && !ev.rearm) {
+			events.shared(slot).id.compare_exchange_strong(id, id | detail::once_flag);
+		}
+	}
+
+	// Claim the handler of an expired event before it runs. A one-shot event is
+	// marked as fired, so that it can no longer be removed. Returns false if the
+	// event has been removed. Does not need the lock.
+	bool claim(std::size_t slot, timer_id id)
+	{
+		std::atomic<timer_id> &shared = events.shared(slot).id;
+		timer_id current = shared.load(std::memory_order_acquire);
+		while(current == (id | detail::once_flag)) {
+			if(shared.compare_exchange_weak(current, id | detail::fired_flag)) {
+				return true;
+			}
+		}
+		return current == id;
+	}
+
+	// Mark an event as removed or expired. Its handler is no longer invoked, and
+	// `extend()` fails. Must be called with the lock held.
+	void invalidate(std::size_t slot)
+	{
+		events[slot].valid = false;
+		events.shared(slot).id.store(events[slot].id | detail::removed_flag);
+		retire_soft(slot);
+	}
+
+	// The deadline of an event, including an extension of a soft deadline. Must
+	// be called with the lock held.
+	const time_point &deadline(std::size_t slot)
+	{
+		event_type &ev = events[slot];
+		if(ev.soft) {
+			typename Clock::rep d = events.shared(slot).deadline.load();
+			if(d > ev.next.time_since_epoch().count()) {
+				ev.next = time_point(typename Clock::duration(d));
+			}
+		}
+		return ev.next;
+	}
+
+	// Remove an event. Stale ids, and one-shot events whose handler has started,
+	// are rejected without touching the queue. Must be called with the lock held.
+	bool cancel(timer_id id)
+	{
+		std::size_t slot = detail::slot_of(id);
+		if(slot >= events.size() || events[slot].id != id || !events[slot].valid ||
+		    events.shared(slot).id.load() == (id | detail::fired_flag)) {
+			return false;
+		}
+		invalidate(slot);
+		events.handler(slot) = Handler();
+		if(queue_of(slot).erase(slot)) {
+			release_id(slot);
+		}
+		return true;
+	}
+
+	bool rearm(timer_id id, const time_point &when, const duration *period)
+	{
+		scoped_m lock(m);
+		if(submit) {
+			// The event may still be in a command.
+			apply_commands();
+		}
+		std::size_t slot = detail::slot_of(id);
+		if(slot >= events.size() || events[slot].id != id || !events[slot].valid) {
+			return false;
+		}
+		event_type &ev = events[slot];
+		if(period != nullptr) {
+			ev.period = *period;
+		}
+		if(ev.soft) {
+			events.shared(slot).deadline.store(when.time_since_epoch().count());
+		}
+		bool wake = false;
+		if(!queue_of(slot).contains(slot)) {
+			// The handler runs. `finish()` renews the event, which can be removed
+			// again even if it is a one-shot event that has fired.
+			ev.rearm = true;
+			std::atomic<timer_id> &shared = events.shared(slot).id;
+			for(timer_id flag : {detail::once_flag, detail::fired_flag}) {
+				timer_id marked = id | flag;
+				shared.compare_exchange_strong(marked, id);
+			}
+		} else if(when < ev.next) {
+			queue_of(slot).update(slot, when);
+			wake = claim_wakeup(when, ev.precise);
+		}
+		// A later deadline is applied when the queue entry expires, see `run()`.
+		ev.next = when;
+		lock.unlock();
+		if(wake) {
+			notify();
+		}
+		return true;
+	}
+
+	Command *new_command(
+	    timer_id id, const time_point &when, duration period, Handler &&handler, bool cancel)
+	{
+		using traits = std::allocator_traits<detail::rebind_alloc<Allocator, Command>>;
+		Command *c = traits::allocate(command_alloc, 1);
+		traits::construct(command_alloc, c, id, when, period, std::move(handler), cancel);
+		return c;
+	}
+
+	void delete_command(Command *c)
+	{
+		using traits = std::allocator_traits<detail::rebind_alloc<Allocator, Command>>;
+		traits::destroy(command_alloc, c);
+		traits::deallocate(command_alloc, c, 1);
+	}
+
+	// Apply the submitted commands. Must be called with the lock held.
+	void apply_commands()
+	{
+		while(detail::Mpsc_queue::Node *n = commands.pop()) {
+			Command *c = static_cast<Command *>(n);
+			if(c->cancel) {
+				cancel(c->id);
+			} else {
+				insert(c->id, c->when, c->period, std::move(c->handler));
+			}
+			delete_command(c);
+		}
+	}
+
+	// Like `claim_wakeup()`, but without the lock, for an event that was submitted
+	// as a command. Not for pollable timers.
+	bool claim_submitted_wakeup(const time_point &when)
+	{
+		typename Clock::rep wake = with_slack(when).time_since_epoch().count();
+		typename Clock::rep h = head.load();
+		while(wake < h) {
+			if(head.compare_exchange_weak(h, std::numeric_limits<typename Clock::rep>::min())) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Whether the timer thread must be woken up for a new deadline.
+	bool earlier_than_head(const time_point &when, bool precise = false) const
+	{
+		time_point wake = precise ? with_margin(when) : with_slack(when);
+		return wake.time_since_epoch().count() < head.load();
+	}
+
+	// The time at which the timer thread starts to spin for a precise event with
+	// deadline `when`.
+	time_point with_margin(const time_point &when) const
+	{
+		if(when < time_point::min() + spin_margin) {
+			return time_point::min();
+		}
+		return when - spin_margin;
+	}
+
+	// The latest time at which an event with deadline `when` may fire.
+	time_point with_slack(const time_point &when) const
+	{
+		if(when > time_point::max() - slack) {
+			return time_point::max();
+		}
+		return when + slack;
+	}
+
+	// The time at which the next event needs to be handled, or `time_point::max()`.
+	// Must be called with the lock held.
+	time_point next_wake()
+	{
+		time_point next = time_point::max();
+		if(!time_events.empty()) {
+			next = with_slack(time_events.next());
+		}
+		if(!precise_events.empty()) {
+			next = std::min(next, precise_events.next());
+		}
+		return next;
+	}
+
+	// Jump the clock to each deadline up to `target` and run its timeouts.
+	std::size_t step_until(const time_point &target)
+	{
+		std::size_t n = 0;
+		for(;;) {
+			time_point next = next_deadline();
+			if(next == time_point::max() || next > target) {
+				return n;
+			}
+			if(Clock::now() < next) {
+				Clock::set(next);
+			}
+			n += process_expired(Clock::now());
+		}
+	}
+
+	// Arm the timerfd of a pollable timer to the next deadline. Must be called
+	// with the lock held.
+	void arm_descriptor()
+	{
+		time_point next = next_wake();
+		if(next == time_point::max()) {
+			head.store(std::numeric_limits<typename Clock::rep>::max());
+			kernel.arm(nullptr);
+			return;
+		}
+		head.store(next.time_since_epoch().count());
+		std::chrono::nanoseconds ns =
+		    std::chrono::duration_cast<std::chrono::nanoseconds>(next.time_since_epoch());
+		kernel.arm(&ns);
+	}
+
+	// Move the events of `q` that are expired at `now` to `expired`. Must be
+	// called with the lock held.
+	void collect(queue_type &q, const time_point &now)
+	{
+		time_event te;
+		while(q.pop_expired(now, te)) {
+			te.next = deadline(te.ref);
+			if(te.next > now) {
+				// The event was postponed by `reschedule()` or `extend()`.
+				q.push(te);
+				continue;
+			}
+			expired.push_back(te);
+		}
+	}
+
+	// Count the events of a batch and how late they are. Only called by the timer
+	// thread.
+	void record_lateness(const time_point &now)
+	{
+		typename Clock::rep total = 0;
+		typename Clock::rep max = max_lateness.load(std::memory_order_relaxed);
+		for(const auto &e : expired) {
+			typename Clock::rep late = (now - e.next).count();
+			total += late;
+			max = std::max(max, late);
+		}
+		fired.fetch_add(expired.size(), std::memory_order_relaxed);
+		lateness.fetch_add(total, std::memory_order_relaxed);
+		max_lateness.store(max, std::memory_order_relaxed);
+	}
+
+	// Whether the timer thread must be woken up for a new deadline. If so, the
+	// timer thread is marked as awake, so that it is only woken up once. Must be
+	// called with the lock held.
+	bool claim_wakeup(const time_point &when, bool precise = false)
+	{
+		if(!earlier_than_head(when, precise)) {
+			return false;
+		}
+		if(pollable) {
+			// There is no timer thread. Move `fd()` to the earlier deadline, which
+			// may still be in a command.
+			if(submit) {
+				apply_commands();
+			}
+			arm_descriptor();
+			return false;
+		}
+		head.store(std::numeric_limits<typename Clock::rep>::min());
+		return true;
+	}
+
+	void notify()
+	{
+		notifications.fetch_add(1, std::memory_order_relaxed);
+		wake_worker();
+	}
+
+	void wake_worker()
+	{
+		if(kernel.valid()) {
+			kernel.wake();
+		} else {
+			cond.notify_all();
+		}
+	}
+
+	// Wait until `until`, or forever if `until` is nullptr, or until there is new
+	// work. Must be called with the lock held.
+	void wait(scoped_m &lock, const time_point *until)
+	{
+		head.store(until != nullptr ? until->time_since_epoch().count()
+		                            : std::numeric_limits<typename Clock::rep>::max());
+		// A command may have been submitted before the new deadline was visible.
+		if(submit && !commands.empty()) {
+			return;
+		}
+		if(kernel.valid()) {
+			using std::chrono::nanoseconds;
+			nanoseconds ns;
+			if(until != nullptr) {
+				ns = std::chrono::duration_cast<nanoseconds>(until->time_since_epoch());
+			}
+			kernel.arm(until != nullptr ? &ns : nullptr);
+			lock.unlock();
+			kernel.wait();
+			lock.lock();
+		} else if(until != nullptr) {
+			cond.wait_until(lock, *until);
+		} else {
+			cond.wait(lock);
+		}
+		head.store(std::numeric_limits<typename Clock::rep>::min());
+		wakeups.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Renew a periodic event, or free the event. Must be called with the lock
+	// held, after the handler has run.
+	void finish(time_event &e)
+	{
+		event_type &ev = events[e.ref];
+		if(ev.valid && ev.rearm) {
+			// The event was rescheduled by its handler or while it ran.
+			ev.rearm = false;
+			e.next = ev.next;
+			queue_of(e.ref).push(e);
+		} else if(ev.valid && ev.period.count() > 0) {
+			// The event is valid and a periodic timer.
+			e.next += std::chrono::duration_cast<typename Clock::duration>(ev.period);
+			ev.next = e.next;
+			queue_of(e.ref).push(e);
+		} else {
+			// The event is either no longer valid because it was removed in the
+			// callback, or it is a one-shot timer.
+			invalidate(e.ref);
+			events.handler(e.ref) = Handler();
+			release_id(e.ref);
+		}
+	}
+
+	// Run the handler of an expired event on a thread of the executor.
+	static void execute(void *owner, timer_id slot)
+	{
+		basic_timer &self = *static_cast<basic_timer *>(owner);
+		scoped_m lock(self.m);
+		event_type &ev = self.events[slot];
+		// The handler is moved out of the event, so that `remove()` from another
+		// thread cannot destroy it while it runs.
+		Handler handler;
+		self.mark_once(slot);
+		if(ev.valid && self.claim(slot, ev.id)) {
+			handler = std::move(self.events.handler(slot));
+			lock.unlock();
+			handler(ev.id);
+			lock.lock();
+			if(ev.valid && (ev.period.count() > 0 || ev.rearm)) {
+				self.events.handler(slot) = std::move(handler);
+			}
+		}
+		time_event e{ev.next, slot};
+		bool renewed = ev.valid && (ev.period.count() > 0 || ev.rearm);
+		self.finish(e);
+		// Wake up the timer thread for the renewed event. The handler stays in
+		// flight until then, so that the destructor cannot destroy the timer
+		// while `notify()` still runs.
+		if(!self.done && renewed && self.claim_wakeup(e.next, ev.precise)) {
+			lock.unlock();
+			self.notify();
+			lock.lock();
+		}
+		--self.in_flight;
+		if(self.done) {
+			// Wake up the destructor, which waits for the last handler.
+			self.cond.notify_all();
+		}
+	}
+
+	void run()
+	{
+		scoped_m lock(m);
+
+		while(!done) {
+
+			if(submit) {
+				apply_commands();
+			}
+
+			if(time_events.empty() && precise_events.empty()) {
+				// Wait for work
+				wait(lock, nullptr);
+				continue;
+			}
+
+			time_point now = detail::exact_now<Clock>();
+			if(dispatch(lock, now) > 0) {
+				continue;
+			}
+			if(!precise_events.empty() &&
+			    (time_events.empty() ||
+			        with_margin(precise_events.next()) < with_slack(time_events.next()))) {
+				time_point next = precise_events.next();
+				time_point until = with_margin(next);
+				if(now < until) {
+					wait(lock, &until);
+				} else {
+					// Spin without the lock, so that timeouts can still be added.
+					lock.unlock();
+					while(detail::exact_now<Clock>() < next) {
+					}
+					lock.lock();
+				}
+				continue;
+			}
+			time_point until = with_slack(time_events.next());
+			wait(lock, &until);
+		}
+	}
+
+	// Collect all events that are expired at `now` and run their handlers, or
+	// hand them to the executor. Returns the number of expired events. Must be
+	// called with the lock held.
+	std::size_t dispatch(scoped_m &lock, const time_point &now)
+	{
+		collect(time_events, now);
+		collect(precise_events, now);
+		std::size_t n = expired.size();
+		if(n == 0) {
+			return 0;
+		}
+		record_lateness(now);
+
+		if(exec != nullptr) {
+			// Hand the handlers to the executor. The events are renewed or freed
+			// when the handlers have finished.
+			for(const auto &e : expired) {
+				++in_flight;
+				exec->post(executor::task{&basic_timer::execute, this, e.ref});
+			}
+			expired.clear();
+			return n;
+		}
+
+		// The handlers are moved out of the events, so that `remove()` from another
+		// thread cannot destroy a handler while it runs. The handlers of renewed
+		// events are moved back afterwards.
+		for(const auto &e : expired) {
+			batch.push_back(std::move(events.handler(e.ref)));
+			mark_once(e.ref);
+		}
+
+		// Invoke the handlers. An event may have been removed by the handler of
+		// an earlier event in the same batch, or from another thread. Its shared
+		// id is then marked as removed.
+		lock.unlock();
+		for(std::size_t i = 0; i < n; ++i) {
+			std::size_t slot = expired[i].ref;
+			timer_id id = events[slot].id;
+			if(claim(slot, id)) {
+				batch[i](id);
+			}
+		}
+		lock.lock();
+
+		for(std::size_t i = 0; i < n; ++i) {
+			event_type &ev = events[expired[i].ref];
+			if(ev.valid && (ev.period.count() > 0 || ev.rearm)) {
+				events.handler(expired[i].ref) = std::move(batch[i]);
+			}
+			finish(expired[i]);
+		}
+		expired.clear();
+		batch.clear();
+		return n;
+	}
+};
+
+using Timer = basic_timer<multiset_queue>;
+
+/**
+ * A set of independent timers (shards), each with its own lock, queue and
+ * thread. On Linux, the thread of each shard can be pinned to one CPU.
+ *
+ * `add()` adds the timeout to the shard of the calling CPU (or thread), and
+ * `add_keyed()` to the shard selected by a key. The handler runs on the thread
+ * of that shard. The returned timer_id contains the index of the shard in its
+ * upper 8 bits, so `remove()` goes directly to the right shard. The handler
+ * type of the shards must be able to hold the user's handler plus an index.
+ */
+template <class Timer = CppTime::Timer>
+class basic_sharded_timer
+{
+public:
+	using clock_type = typename Timer::clock_type;
+	using time_point = typename Timer::time_point;
+	using handler_type = typename Timer::handler_type;
+
+private:
+	static const std::size_t shard_shift = std::numeric_limits<timer_id>::digits - 8;
+	static const timer_id local_mask = (timer_id(1) << shard_shift) - 1;
+	static_assert(shard_shift == detail::slot_bits + detail::generation_bits,
+	    "The shard index must use exactly the bits above the timer_id of a shard");
+
+	// Passes the id with the shard index to the user's handler.
+	struct Shard_handler {
+		handler_type handler;
+		std::size_t shard;
+		void operator()(timer_id id) const
+		{
+			handler((timer_id(shard) << shard_shift) | id);
+		}
+	};
+
+	std::vector<std::unique_ptr<Timer>> shards;
+	bool all_pinned;
+
+	// Returns false if the thread could not be pinned, e.g. because the CPU does
+	// not exist or is not allowed for this process.
+	static bool pin(Timer &t, std::size_t cpu)
+	{
+#if defined(__linux__)
+		if(cpu >= CPU_SETSIZE) {
+			return false;
+		}
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(t.native_handle(), sizeof(set), &set) == 0;
+#else
+		(void)t;
+		(void)cpu;
+		return false;
+#endif
+	}
+
+	timer_id add_to(std::size_t shard, const time_point &when, handler_type &&handler,
+	    const duration &period)
+	{
+		timer_id id = shards[shard]->add(
+		    when, handler_type(Shard_handler{std::move(handler), shard}), period);
+		return (timer_id(shard) << shard_shift) | id;
+	}
+
+public:
+	/**
+	 * Create `n` shards, by default one per CPU. If `pin_threads` is set, the
+	 * thread of shard i is pinned to CPU i, see `pinned()`. In poll mode, the
+	 * shards have no thread, and nothing is pinned.
+	 */
+	explicit basic_sharded_timer(std::size_t n = std::thread::hardware_concurrency(),
+	    bool pin_threads = false, const timer_options &opts = timer_options())
+	    : shards{}, all_pinned(pin_threads && !opts.poll)
+	{
+		n = n == 0 ? 1 : (n > 256 ? 256 : n);
+		for(std::size_t i = 0; i < n; ++i) {
+			shards.emplace_back(new Timer(opts));
+			if(pin_threads && !opts.poll && !pin(*shards.back(), i)) {
+				all_pinned = false;
+			}
+		}
+	}
+
+	/**
+	 * Whether the thread of every shard has been pinned to its CPU. Pinning
+	 * fails if there are fewer CPUs than shards, or if the CPU is not allowed
+	 * for this process. The threads that could not be pinned keep running
+	 * unpinned.
+	 */
+	bool pinned() const
+	{
+		return all_pinned;
+	}
+
+	std::size_t size() const
+	{
+		return shards.size();
+	}
+
+	// The shard of the calling thread.
+	std::size_t current_shard() const
+	{
+#if defined(__linux__)
+		int cpu = sched_getcpu();
+		if(cpu >= 0) {
+			return std::size_t(cpu) % shards.size();
+		}
+#endif
+		return std::hash<std::thread::id>()(std::this_thread::get_id()) % shards.size();
+	}
+
+	/**
+	 * Add a timeout to the shard of the calling thread. See `basic_timer::add()`.
+	 */
+	timer_id add(const time_point &when, handler_type &&handler,
+	    const duration &period = duration::zero())
+	{
+		return add_to(current_shard(), when, std::move(handler), period);
+	}
+
+	template <class Rep, class Period>
+	timer_id add(const std::chrono::duration<Rep, Period> &when, handler_type &&handler,
+	    const duration &period = duration::zero())
+	{
+		return add(
+		    detail::ceil_now<clock_type>() +
+		        std::chrono::duration_cast<typename clock_type::duration>(when),
+		    std::move(handler), period);
+	}
+
+	/**
+	 * Add a timeout to the shard selected by `key`, e.g. a connection id, so that
+	 * all timeouts with the same key run on the same thread.
+	 */
+	timer_id add_keyed(std::size_t key, const time_point &when, handler_type &&handler,
+	    const duration &period = duration::zero())
+	{
+		return add_to(key % shards.size(), when, std::move(handler), period);
+	}
+
+	template <class Rep, class Period>
+	timer_id add_keyed(std::size_t key, const std::chrono::duration<Rep, Period> &when,
+	    handler_type &&handler, const duration &period = duration::zero())
+	{
+		return add_keyed(key,
+		    detail::ceil_now<clock_type>() +
+		        std::chrono::duration_cast<typename clock_type::duration>(when),
+		    std::move(handler), period);
+	}
+
+	/**
+	 * Removes the timer with the given id.
+	 */
+	bool remove(timer_id id)
+	{
+		std::size_t shard = std::size_t(id >> shard_shift);
+		if(shard >= shards.size()) {
+			return false;
+		}
+		return shards[shard]->remove(id & local_mask);
+	}
+
+	/**
+	 * Moves the next timeout of the timer with the given id. See
+	 * `basic_timer::reschedule()`.
+	 */
+	bool reschedule(timer_id id, const time_point &when)
+	{
+		std::size_t shard = std::size_t(id >> shard_shift);
+		if(shard >= shards.size()) {
+			return false;
+		}
+		return shards[shard]->reschedule(id & local_mask, when);
+	}
+
+	bool reschedule(timer_id id, const time_point &when, const duration &period)
+	{
+		std::size_t shard = std::size_t(id >> shard_shift);
+		if(shard >= shards.size()) {
+			return false;
+		}
+		return shards[shard]->reschedule(id & local_mask, when, period);
+	}
+
+	template <class Rep, class Period>
+	bool reschedule(timer_id id, const std::chrono::duration<Rep, Period> &when)
+	{
+		return reschedule(id,
+		    detail::ceil_now<clock_type>() +
+		        std::chrono::duration_cast<typename clock_type::duration>(when));
+	}
+};
+
+using ShardedTimer = basic_sharded_timer<Timer>;
 
 } // end namespace CppTime
 
@@ -0,0 +1,602 @@
+/**
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Michael Egli
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * \author    Michael Egli
+ * \copyright Michael Egli
+ * \date      11-Jul-2015
+ *
+ * \file timer_bench.cpp
+ *
+ * Benchmarks for cpptime component. Compile with
+ *
+ * ~~~
+ * g++ -std=c++11 -O2 -Wall -Wextra -o bench timer_bench.cpp -l pthread
+ * ~~~
+ *
+ * Run all benchmarks with `./bench`, or a single one with `./bench <name>`.
+ */
+
+// Includes
+#include "../cpptime.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std::chrono;
+
+namespace
+{
+
+using time_event = CppTime::detail::Time_event<CppTime::clock>;
+
+// Nanoseconds per operation since `start`.
+double ns_per_op(steady_clock::time_point start, std::size_t ops)
+{
+	auto d = duration_cast<nanoseconds>(steady_clock::now() - start);
+	return double(d.count()) / double(ops);
+}
+
+// Random expiry times for `n` timeouts, spread over `spread`.
+std::vector<CppTime::timestamp> make_times(std::size_t n, milliseconds spread)
+{
+	std::mt19937_64 rng(42);
+	std::uniform_int_distribution<int64_t> dist(0, duration_cast<microseconds>(spread).count());
+	CppTime::timestamp now = CppTime::clock::now();
+	std::vector<CppTime::timestamp> times(n);
+	for(auto &t : times) {
+		t = now + microseconds(dist(rng));
+	}
+	return times;
+}
+
+// Add `n` timeouts to a queue, then expire all of them.
+template <class Policy>
+void queue_insert_expire(const char *name, std::size_t n)
+{
+	auto times = make_times(n, seconds(60));
+	typename Policy::template queue<CppTime::clock> q;
+	auto start = steady_clock::now();
+	for(std::size_t i = 0; i < n; ++i) {
+		q.push(time_event{times[i], i});
+	}
+	double insert = ns_per_op(start, n);
+
+	start = steady_clock::now();
+	time_event te;
+	CppTime::timestamp now = times[0];
+	std::size_t popped = 0;
+	while(!q.empty()) {
+		now = q.next();
+		while(q.pop_expired(now, te)) {
+			++popped;
+		}
+	}
+	double expire = ns_per_op(start, popped);
+	std::printf("%-24s n=%-8zu insert %8.1f ns/op  expire %8.1f ns/op\n", name, n, insert, expire);
+}
+
+void bench_queue(std::size_t n)
+{
+	queue_insert_expire<CppTime::multiset_queue>("multiset_queue", n);
+	queue_insert_expire<CppTime::heap_queue>("heap_queue", n);
+	queue_insert_expire<CppTime::wheel_queue<milliseconds>>("wheel_queue<ms>", n);
+	queue_insert_expire<CppTime::wheel_queue<microseconds, 5>>("wheel_queue<us, 5>", n);
+}
+
+void bench_queue()
+{
+	bench_queue(1000);
+	bench_queue(100000);
+	bench_queue(500000);
+}
+
+// Add `n` timeouts to a timer, then cancel all of them.
+template <class Timer>
+void timer_cancel(const char *name, std::size_t n)
+{
+	auto times = make_times(n, seconds(60));
+	std::vector<CppTime::timer_id> ids(n);
+	Timer t;
+	for(std::size_t i = 0; i < n; ++i) {
+		ids[i] = t.add(times[i] + hours(1), [](CppTime::timer_id) {});
+	}
+	// Cancel in random order, so that the position in the queue does not help.
+	std::shuffle(ids.begin(), ids.end(), std::mt19937_64(7));
+	auto start = steady_clock::now();
+	for(auto id : ids) {
+		t.remove(id);
+	}
+	std::printf("%-24s n=%-8zu remove %8.1f ns/op\n", name, n, ns_per_op(start, n));
+}
+
+void bench_cancel()
+{
+	timer_cancel<CppTime::Timer>("multiset_queue", 1000000);
+	timer_cancel<CppTime::basic_timer<CppTime::heap_queue>>("heap_queue", 1000000);
+	timer_cancel<CppTime::basic_timer<CppTime::wheel_queue<milliseconds>>>(
+	    "wheel_queue<ms>", 1000000);
+}
+
+// Add `n` timeouts with the same deadline and measure how long it takes to
+// fire all of them.
+template <class Timer>
+void timer_same_deadline(const char *name, std::size_t n)
+{
+	std::atomic<std::size_t> fired{0};
+	Timer t;
+	auto deadline = CppTime::clock::now() + milliseconds(200);
+	for(std::size_t i = 0; i < n; ++i) {
+		t.add(deadline, [&](CppTime::timer_id) { ++fired; });
+	}
+	while(CppTime::clock::now() < deadline) {
+		std::this_thread::sleep_for(milliseconds(1));
+	}
+	while(fired < n) {
+		std::this_thread::yield();
+	}
+	double per_fire = ns_per_op(deadline, n);
+	std::printf("%-24s n=%-8zu fire   %8.1f ns/op  %10.0f fires/s\n", name, n, per_fire,
+	    1e9 / per_fire);
+}
+
+void bench_same_deadline()
+{
+	timer_same_deadline<CppTime::Timer>("multiset_queue", 100000);
+	timer_same_deadline<CppTime::basic_timer<CppTime::heap_queue>>("heap_queue", 100000);
+	timer_same_deadline<CppTime::basic_timer<CppTime::wheel_queue<milliseconds>>>(
+	    "wheel_queue<ms>", 100000);
+}
+
+// Add `n` idle timeouts and postpone each of them `touches` times, either with
+// `reschedule()`, with `remove()` and `add()`, or with `extend()` of a soft
+// deadline.
+template <class Timer>
+void timer_touch(const char *name, std::size_t n, std::size_t touches)
+{
+	std::vector<CppTime::timer_id> ids(n);
+	Timer t;
+	for(auto &id : ids) {
+		id = t.add(seconds(10), [](CppTime::timer_id) {});
+	}
+	auto start = steady_clock::now();
+	for(std::size_t k = 1; k <= touches; ++k) {
+		for(auto id : ids) {
+			t.reschedule(id, seconds(10) + milliseconds(k));
+		}
+	}
+	double reschedule = ns_per_op(start, n * touches);
+	start = steady_clock::now();
+	for(std::size_t k = 1; k <= touches; ++k) {
+		for(auto &id : ids) {
+			t.remove(id);
+			id = t.add(seconds(10) + milliseconds(k), [](CppTime::timer_id) {});
+		}
+	}
+	double readd = ns_per_op(start, n * touches);
+	for(auto &id : ids) {
+		t.remove(id);
+		id = t.add_soft(seconds(10), [](CppTime::timer_id) {});
+	}
+	start = steady_clock::now();
+	for(std::size_t k = 1; k <= touches; ++k) {
+		auto when = CppTime::clock::now() + seconds(10);
+		for(auto id : ids) {
+			t.extend(id, when);
+		}
+	}
+	double extend = ns_per_op(start, n * touches);
+	std::printf("%-24s n=%-8zu reschedule %6.1f ns/op  remove+add %6.1f ns/op  "
+	            "extend %6.1f ns/op\n",
+	    name, n, reschedule, readd, extend);
+}
+
+void bench_touch()
+{
+	timer_touch<CppTime::Timer>("multiset_queue", 100000, 10);
+	timer_touch<CppTime::basic_timer<CppTime::heap_queue>>("heap_queue", 100000, 10);
+	timer_touch<CppTime::basic_timer<CppTime::wheel_queue<milliseconds>>>(
+	    "wheel_queue<ms>", 100000, 10);
+}
+
+// Fire `n` timeouts spread over 200 ms with the given slack, and report the
+// wakeups of the timer thread against the lateness of the timeouts.
+void timer_slack(microseconds slack, std::size_t n)
+{
+	CppTime::timer_options opts;
+	opts.slack = slack;
+	CppTime::Timer t(opts);
+	std::atomic<std::size_t> fired{0};
+	auto start = CppTime::clock::now() + milliseconds(10);
+	for(std::size_t i = 0; i < n; ++i) {
+		t.add(start + microseconds(i * 200000 / n), [&](CppTime::timer_id) { ++fired; });
+	}
+	while(fired < n) {
+		std::this_thread::sleep_for(milliseconds(1));
+	}
+	auto stats = t.stats();
+	std::printf("slack %6lld us  n=%-8zu wakeups %6llu  lateness mean %8.1f us  max %8.1f us\n",
+	    static_cast<long long>(slack.count()), n, static_cast<unsigned long long>(stats.wakeups),
+	    duration_cast<nanoseconds>(stats.lateness).count() / 1e3 / double(stats.fired),
+	    duration_cast<nanoseconds>(stats.max_lateness).count() / 1e3);
+}
+
+void bench_slack()
+{
+	for(long long slack : {0, 100, 1000, 10000}) {
+		timer_slack(microseconds(slack), 10000);
+	}
+}
+
+// Fire `n` timeouts 2 ms apart and report how late their handlers ran.
+void timer_lateness(const char *name, microseconds spin_margin, bool precise, bool kernel_wait,
+    std::size_t n)
+{
+	CppTime::timer_options opts;
+	opts.spin_margin = spin_margin;
+	opts.kernel_wait = kernel_wait;
+	CppTime::Timer t(opts);
+	std::vector<nanoseconds> late(n);
+	std::atomic<std::size_t> fired{0};
+	auto start = CppTime::clock::now() + milliseconds(10);
+	for(std::size_t i = 0; i < n; ++i) {
+		auto when = start + milliseconds(2 * i);
+		auto handler = [&late, &fired, when, i](CppTime::timer_id) {
+			late[i] = duration_cast<nanoseconds>(CppTime::clock::now() - when);
+			++fired;
+		};
+		if(precise) {
+			t.add_precise(when, handler);
+		} else {
+			t.add(when, handler);
+		}
+	}
+	while(fired < n) {
+		std::this_thread::sleep_for(milliseconds(5));
+	}
+	std::sort(late.begin(), late.end());
+	double sum = 0;
+	for(auto l : late) {
+		sum += double(l.count());
+	}
+	std::printf("%-24s n=%-8zu lateness mean %8.1f us  p99 %8.1f us  max %8.1f us\n", name, n,
+	    sum / double(n) / 1e3, double(late[n * 99 / 100].count()) / 1e3,
+	    double(late.back().count()) / 1e3);
+}
+
+void bench_lateness()
+{
+	timer_lateness("wait", microseconds(0), false, false, 500);
+	timer_lateness("kernel_wait", microseconds(0), false, true, 500);
+	timer_lateness("spin_margin 100 us", microseconds(100), true, false, 500);
+	timer_lateness("spin_margin 500 us", microseconds(500), true, false, 500);
+}
+
+// Add and remove timeouts from `threads` producer threads at the same time.
+void timer_producers(const char *name, const CppTime::timer_options &opts, std::size_t threads)
+{
+	const std::size_t per_thread = 200000 / threads;
+	CppTime::Timer t(opts);
+	std::vector<std::thread> producers;
+	auto start = steady_clock::now();
+	for(std::size_t p = 0; p < threads; ++p) {
+		producers.emplace_back([&]() {
+			std::vector<CppTime::timer_id> ids(per_thread);
+			for(auto &id : ids) {
+				id = t.add(hours(1), [](CppTime::timer_id) {});
+			}
+			for(auto id : ids) {
+				t.remove(id);
+			}
+		});
+	}
+	for(auto &p : producers) {
+		p.join();
+	}
+	std::printf("%-24s threads=%-3zu add+remove %8.1f ns/op\n", name, threads,
+	    ns_per_op(start, per_thread * threads));
+}
+
+void bench_producers()
+{
+	CppTime::timer_options locked;
+	CppTime::timer_options lock_free;
+	lock_free.lock_free_submit = true;
+	for(std::size_t threads = 1; threads <= 32; threads *= 2) {
+		timer_producers("locked", locked, threads);
+		timer_producers("lock_free_submit", lock_free, threads);
+	}
+}
+
+// Read `Clock` `n` times, then add and remove `n` timeouts with a duration on a
+// timer of that clock.
+template <class Clock>
+void clock_cost(const char *name, std::size_t n)
+{
+	auto start = steady_clock::now();
+	volatile typename Clock::rep sink = 0;
+	for(std::size_t i = 0; i < n; ++i) {
+		sink = Clock::now().time_since_epoch().count();
+	}
+	(void)sink;
+	double read = ns_per_op(start, n);
+	CppTime::basic_timer<CppTime::multiset_queue, Clock> t;
+	std::vector<CppTime::timer_id> ids(n);
+	start = steady_clock::now();
+	for(auto &id : ids) {
+		id = t.add(seconds(10), [](CppTime::timer_id) {});
+	}
+	for(auto id : ids) {
+		t.remove(id);
+	}
+	std::printf("%-24s now() %8.1f ns  add+remove %8.1f ns/op\n", name, read,
+	    ns_per_op(start, n));
+}
+
+void bench_clocks()
+{
+	clock_cost<steady_clock>("steady_clock", 1000000);
+	clock_cost<CppTime::coarse_clock>("coarse_clock", 1000000);
+	clock_cost<CppTime::tsc_clock>("tsc_clock", 1000000);
+	clock_cost<CppTime::cached_clock<>>("cached_clock", 1000000);
+}
+
+// Add and remove `total` timeouts in batches of `batch`, one by one and with
+// `add_bulk()` and `remove_bulk()`. Each batch is earlier than the last one, so
+// that every batch has to wake up the timer thread.
+template <class Timer>
+void timer_bulk(const char *name, std::size_t batch, std::size_t total)
+{
+	std::size_t rounds = total / batch;
+	std::vector<CppTime::timer_id> ids;
+	ids.reserve(batch);
+	double single[2];
+	double bulk[2];
+	for(int b = 0; b < 2; ++b) {
+		Timer t;
+		auto when = CppTime::clock::now() + hours(1);
+		double add_ns = 0;
+		double remove_ns = 0;
+		for(std::size_t r = 0; r < rounds; ++r) {
+			when -= milliseconds(1);
+			ids.clear();
+			auto start = steady_clock::now();
+			if(b == 0) {
+				for(std::size_t i = 0; i < batch; ++i) {
+					ids.push_back(t.add(when, [](CppTime::timer_id) {}));
+				}
+			} else {
+				std::vector<typename Timer::bulk_timeout> timeouts;
+				timeouts.reserve(batch);
+				for(std::size_t i = 0; i < batch; ++i) {
+					timeouts.push_back({when, [](CppTime::timer_id) {}});
+				}
+				ids = t.add_bulk(timeouts);
+			}
+			add_ns += ns_per_op(start, total);
+			start = steady_clock::now();
+			if(b == 0) {
+				for(auto id : ids) {
+					t.remove(id);
+				}
+			} else {
+				t.remove_bulk(ids);
+			}
+			remove_ns += ns_per_op(start, total);
+		}
+		(b == 0 ? single : bulk)[0] = add_ns;
+		(b == 0 ? single : bulk)[1] = remove_ns;
+	}
+	std::printf("%-24s batch=%-6zu add %7.1f / bulk %7.1f ns  remove %7.1f / bulk %7.1f ns\n",
+	    name, batch, single[0], bulk[0], single[1], bulk[1]);
+}
+
+void bench_bulk()
+{
+	for(std::size_t batch : {1, 64, 10000}) {
+		timer_bulk<CppTime::Timer>("multiset_queue", batch, 100000);
+		timer_bulk<CppTime::basic_timer<CppTime::heap_queue>>("heap_queue", batch, 100000);
+	}
+}
+
+// Simulate `sources` sources that each schedule their next arrival after a
+// random gap of up to a minute, for `days` of virtual time. The timer jumps the
+// manual clock from one deadline to the next instead of waiting.
+template <class Policy>
+void timer_simulation(const char *name, std::size_t sources, int days)
+{
+	CppTime::timer_options opts;
+	opts.poll = true;
+	CppTime::basic_timer<Policy, CppTime::manual_clock, CppTime::handler_t, CppTime::null_lock> t(
+	    opts);
+	std::mt19937_64 rng(42);
+	std::uniform_int_distribution<int64_t> gap(1, 60000);
+	std::function<void()> arrive = [&]() {
+		t.add(milliseconds(gap(rng)), [&](CppTime::timer_id) { arrive(); });
+	};
+	for(std::size_t i = 0; i < sources; ++i) {
+		arrive();
+	}
+	auto start = steady_clock::now();
+	std::size_t n = t.advance(hours(24 * days));
+	auto wall = duration_cast<milliseconds>(steady_clock::now() - start);
+	std::printf("%-24s sources=%-6zu days=%-3d events %9zu  %8.1f ns/event  wall %6lld ms\n",
+	    name, sources, days, n, ns_per_op(start, n), static_cast<long long>(wall.count()));
+}
+
+void bench_simulation()
+{
+	timer_simulation<CppTime::multiset_queue>("multiset_queue", 1000, 1);
+	timer_simulation<CppTime::heap_queue>("heap_queue", 1000, 1);
+	timer_simulation<CppTime::wheel_queue<milliseconds>>("wheel_queue<ms>", 1000, 1);
+}
+
+#if defined(__linux__)
+// Counts the hardware cache misses of this process, including the threads that
+// are started after the counter was opened. The counts of a thread are only
+// added when it exits.
+class Cache_misses
+{
+	int fd;
+
+public:
+	Cache_misses()
+	{
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+	}
+	~Cache_misses()
+	{
+		if(fd >= 0) {
+			close(fd);
+		}
+	}
+	bool valid() const
+	{
+		return fd >= 0;
+	}
+	long long read() const
+	{
+		long long v = 0;
+		if(::read(fd, &v, sizeof(v)) != sizeof(v)) {
+			return 0;
+		}
+		return v;
+	}
+};
+#else
+class Cache_misses
+{
+public:
+	bool valid() const
+	{
+		return false;
+	}
+	long long read() const
+	{
+		return 0;
+	}
+};
+#endif
+
+// Add `n` timeouts and, if `fire` is set, wait until all of them have fired.
+// Returns the cache misses of the whole run, or -1 if they can't be counted.
+template <class Timer>
+long long timer_misses(std::size_t n, bool fire, double &per_fire)
+{
+	Cache_misses misses;
+	std::atomic<std::size_t> fired{0};
+	// Without `fire`, the timeouts are far enough in the future to never expire.
+	auto deadline = CppTime::clock::now() + (fire ? milliseconds(500) : milliseconds(3600000));
+	{
+		Timer t;
+		for(std::size_t i = 0; i < n; ++i) {
+			t.add(deadline + microseconds(i % 1000), [&](CppTime::timer_id) { ++fired; });
+		}
+		if(fire) {
+			while(CppTime::clock::now() < deadline) {
+				std::this_thread::sleep_for(milliseconds(1));
+			}
+			while(fired < n) {
+				std::this_thread::yield();
+			}
+			per_fire = ns_per_op(deadline, n);
+		}
+	}
+	return misses.valid() ? misses.read() : -1;
+}
+
+// Cache misses per fired timeout with many timeouts. The misses of adding the
+// timeouts are measured in a separate run and subtracted.
+template <class Timer>
+void timer_cache_misses(const char *name, std::size_t n)
+{
+	double per_fire = 0;
+	long long add = timer_misses<Timer>(n, false, per_fire);
+	long long all = timer_misses<Timer>(n, true, per_fire);
+	if(add < 0 || all < 0) {
+		std::printf("%-24s n=%-8zu fire   %8.1f ns/op  misses/fire n/a\n", name, n, per_fire);
+	} else {
+		std::printf("%-24s n=%-8zu fire   %8.1f ns/op  misses/fire %6.2f\n", name, n, per_fire,
+		    double(all - add) / double(n));
+	}
+}
+
+void bench_cache_misses()
+{
+	timer_cache_misses<CppTime::Timer>("multiset_queue", 1000000);
+	timer_cache_misses<CppTime::basic_timer<CppTime::heap_queue>>("heap_queue", 1000000);
+	timer_cache_misses<CppTime::basic_timer<CppTime::wheel_queue<milliseconds>>>(
+	    "wheel_queue<ms>", 1000000);
+}
+
+struct Benchmark {
+	const char *name;
+	void (*run)();
+};
+
+const Benchmark benchmarks[] = {
+    {"queue", bench_queue},
+    {"cancel", bench_cancel},
+    {"same_deadline", bench_same_deadline},
+    {"touch", bench_touch},
+    {"slack", bench_slack},
+    {"lateness", bench_lateness},
+    {"producers", bench_producers},
+    {"simulation", bench_simulation},
+    {"clocks", bench_clocks},
+    {"bulk", bench_bulk},
+    {"cache_misses", bench_cache_misses},
+};
+
+} // end anonymous namespace
+
+int main(int argc, char **argv)
+{
+	for(const auto &b : benchmarks) {
+		if(argc < 2 || std::strcmp(argv[1], b.name) == 0) {
+			std::printf("== %s\n", b.name);
+			b.run();
+		}
+	}
+	return 0;
+}
@@ -40,11 +40,150 @@
 // Includes
 #include "../cpptime.h"
 #include "catch.hpp"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <string>
 #include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 using namespace std::chrono;
 
+// Count all allocations, to check that the timer does not allocate.
+static std::atomic<std::size_t> allocations{0};
+
+void *operator new(std::size_t n)
+{
+	++allocations;
+	if(void *p = std::malloc(n == 0 ? 1 : n)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new(std::size_t n, const std::nothrow_t &) noexcept
+{
+	++allocations;
+	return std::malloc(n == 0 ? 1 : n);
+}
+
+void *operator new[](std::size_t n)
+{
+	return operator new(n);
+}
+
+void *operator new[](std::size_t n, const std::nothrow_t &t) noexcept
+{
+	return operator new(n, t);
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+	std::free(p);
+}
+
+#if defined(__cpp_sized_deallocation)
+void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+#endif
+
+using time_event = CppTime::detail::Time_event<CppTime::clock>;
+
+// Wait until `done()` returns true, for at most a second. Tests that need the
+// timer thread wait with this instead of sleeping for a fixed time.
+template <class Pred>
+bool eventually(Pred done)
+{
+	auto until = steady_clock::now() + seconds(1);
+	while(!done()) {
+		if(steady_clock::now() > until) {
+			return false;
+		}
+		std::this_thread::sleep_for(milliseconds(1));
+	}
+	return true;
+}
+
+// An allocator that counts the bytes it has handed out, and does not use the
+// global operator new.
+template <class T>
+struct counting_allocator {
+	using value_type = T;
+	std::atomic<std::size_t> *bytes;
+
+	explicit counting_allocator(std::atomic<std::size_t> *bytes) : bytes(bytes)
+	{
+	}
+	template <class U>
+	counting_allocator(const counting_allocator<U> &r) : bytes(r.bytes)
+	{
+	}
+	T *allocate(std::size_t n)
+	{
+		*bytes += n * sizeof(T);
+		if(void *p = std::malloc(n * sizeof(T))) {
+			return static_cast<T *>(p);
+		}
+		throw std::bad_alloc();
+	}
+	void deallocate(T *p, std::size_t)
+	{
+		std::free(p);
+	}
+	template <class U>
+	bool operator==(const counting_allocator<U> &r) const
+	{
+		return bytes == r.bytes;
+	}
+	template <class U>
+	bool operator!=(const counting_allocator<U> &r) const
+	{
+		return bytes != r.bytes;
+	}
+};
+
+// A timer on the manual clock, without a thread. `advance()` runs the expired
+// handlers on the calling thread, so the tests do not need to sleep.
+using Manual_timer = CppTime::basic_timer<CppTime::multiset_queue, CppTime::manual_clock>;
+
+CppTime::timer_options poll_options()
+{
+	CppTime::timer_options opts;
+	opts.poll = true;
+	return opts;
+}
+
 TEST_CASE("Test start and stop.")
 {
 	{
@@ -52,15 +191,71 @@ TEST_CASE("Test start and stop.")
 	}
 }
 
+TEST_CASE("Test manual clock")
+{
+	Manual_timer t(poll_options());
+	std::vector<Manual_timer::time_point> seen;
+	auto start = CppTime::manual_clock::now();
+	auto record = [&](CppTime::timer_id) { seen.push_back(CppTime::manual_clock::now()); };
+	t.add(milliseconds(30), record);
+	t.add(milliseconds(10), record, milliseconds(15));
+
+	REQUIRE(t.advance(milliseconds(5)) == 0);
+	REQUIRE(CppTime::manual_clock::now() == start + milliseconds(5));
+	REQUIRE(t.advance(milliseconds(35)) == 4);
+	REQUIRE(CppTime::manual_clock::now() == start + milliseconds(40));
+	REQUIRE(seen.size() == 4);
+	REQUIRE(seen[0] == start + milliseconds(10));
+	REQUIRE(seen[1] == start + milliseconds(25));
+	REQUIRE(seen[2] == start + milliseconds(30));
+	REQUIRE(seen[3] == start + milliseconds(40));
+}
+
+TEST_CASE("Test discrete-event simulation")
+{
+	Manual_timer t(poll_options());
+	auto start = CppTime::manual_clock::now();
+
+	SECTION("Run until a target")
+	{
+		int i = 0;
+		t.add(hours(2), [&](CppTime::timer_id) { i = 42; });
+		t.add(hours(24 * 3), [&](CppTime::timer_id) { i = 43; });
+		REQUIRE(t.run_until(start + hours(24)) == 1);
+		REQUIRE(i == 42);
+		REQUIRE(CppTime::manual_clock::now() == start + hours(24));
+		REQUIRE(t.run_until(start + hours(24 * 3)) == 1);
+		REQUIRE(i == 43);
+	}
+
+	SECTION("Run until no timeout is left")
+	{
+		// Each arrival schedules the next one, a day of one arrival per minute.
+		int arrivals = 0;
+		std::function<void()> schedule = [&]() {
+			t.add(minutes(1), [&](CppTime::timer_id) {
+				if(++arrivals < 24 * 60) {
+					schedule();
+				}
+			});
+		};
+		schedule();
+		REQUIRE(t.run_until_empty() == 24 * 60);
+		REQUIRE(arrivals == 24 * 60);
+		REQUIRE(CppTime::manual_clock::now() == start + hours(24));
+		REQUIRE(t.run_until_empty() == 0);
+	}
+}
+
 TEST_CASE("Tests with two argument add")
 {
-	CppTime::Timer t;
+	Manual_timer t(poll_options());
 
 	SECTION("Test uint64_t timeout argument")
 	{
 		int i = 0;
 		t.add(100000, [&](CppTime::timer_id) { i = 42; });
-		std::this_thread::sleep_for(milliseconds(120));
+		t.advance(milliseconds(120));
 		REQUIRE(i == 42);
 	}
 
@@ -68,29 +263,29 @@ TEST_CASE("Tests with two argument add")
 	{
 		int i = 0;
 		t.add(milliseconds(100), [&](CppTime::timer_id) { i = 43; });
-		std::this_thread::sleep_for(milliseconds(120));
+		t.advance(milliseconds(120));
 		REQUIRE(i == 43);
 	}
 
 	SECTION("Test time_point timeout argument")
 	{
 		int i = 0;
-		t.add(CppTime::clock::now() + milliseconds(100), [&](CppTime::timer_id) { i = 44; });
-		std::this_thread::sleep_for(milliseconds(120));
+		t.add(CppTime::manual_clock::now() + milliseconds(100), [&](CppTime::timer_id) { i = 44; });
+		t.advance(milliseconds(120));
 		REQUIRE(i == 44);
 	}
 }
 
 TEST_CASE("Tests with three argument add")
 {
-	CppTime::Timer t;
+	Manual_timer t(poll_options());
 
 	SECTION("Test uint64_t timeout argument")
 	{
 		size_t count = 0;
 		auto id = t.add(
 		    100000, [&](CppTime::timer_id) { ++count; }, 10000);
-		std::this_thread::sleep_for(milliseconds(125));
+		t.advance(milliseconds(125));
 		t.remove(id);
 		REQUIRE(count == 3);
 	}
@@ -100,7 +295,7 @@ TEST_CASE("Tests with three argument add")
 		size_t count = 0;
 		auto id = t.add(
 		    milliseconds(100), [&](CppTime::timer_id) { ++count; }, microseconds(10000));
-		std::this_thread::sleep_for(milliseconds(135));
+		t.advance(milliseconds(135));
 		t.remove(id);
 		REQUIRE(count == 4);
 	}
@@ -108,7 +303,7 @@ TEST_CASE("Tests with three argument add")
 
 TEST_CASE("Test delete timer in callback")
 {
-	CppTime::Timer t;
+	Manual_timer t(poll_options());
 
 	SECTION("Delete one timer")
 	{
@@ -120,7 +315,7 @@ TEST_CASE("Test delete timer in callback")
 			    t.remove(id);
 		    },
 		    milliseconds(10));
-		std::this_thread::sleep_for(milliseconds(50));
+		t.advance(milliseconds(50));
 		REQUIRE(count == 1);
 	}
 
@@ -128,26 +323,70 @@ TEST_CASE("Test delete timer in callback")
 	{
 		auto id1 = t.add(milliseconds(40), [](CppTime::timer_id) {});
 		auto id2 = t.add(milliseconds(10), [&](CppTime::timer_id id) { t.remove(id); });
-		std::this_thread::sleep_for(milliseconds(30));
+		t.advance(milliseconds(30));
 		auto id3 = t.add(microseconds(100), [](CppTime::timer_id) {});
 		auto id4 = t.add(microseconds(100), [](CppTime::timer_id) {});
-		REQUIRE(id3 == id2);
+		REQUIRE(CppTime::detail::slot_of(id3) == CppTime::detail::slot_of(id2));
+		REQUIRE(id3 != id2);
 		REQUIRE(id4 != id1);
 		REQUIRE(id4 != id2);
-		std::this_thread::sleep_for(milliseconds(20));
+		REQUIRE(t.remove(id2) == false);
+		t.advance(milliseconds(20));
 	}
 
 	SECTION("Ensure that the correct timer is freed and reused - different ordering")
 	{
 		auto id1 = t.add(milliseconds(10), [&](CppTime::timer_id id) { t.remove(id); });
 		auto id2 = t.add(milliseconds(40), [](CppTime::timer_id) {});
-		std::this_thread::sleep_for(milliseconds(30));
+		t.advance(milliseconds(30));
 		auto id3 = t.add(microseconds(100), [](CppTime::timer_id) {});
 		auto id4 = t.add(microseconds(100), [](CppTime::timer_id) {});
-		REQUIRE(id3 == id1);
+		REQUIRE(CppTime::detail::slot_of(id3) == CppTime::detail::slot_of(id1));
+		REQUIRE(id3 != id1);
 		REQUIRE(id4 != id1);
 		REQUIRE(id4 != id2);
-		std::this_thread::sleep_for(milliseconds(20));
+		REQUIRE(t.remove(id1) == false);
+		t.advance(milliseconds(20));
+	}
+
+	SECTION("A one-shot timer that has fired in the same batch cannot be removed")
+	{
+		CppTime::timer_options opts = poll_options();
+		for(bool lock_free : {false, true}) {
+			opts.lock_free_submit = lock_free;
+			Manual_timer m(opts);
+			int count = 0;
+			bool removed_first = true;
+			bool removed_self = true;
+			bool removed_third = false;
+			CppTime::timer_id third = 0;
+			auto first = m.add(milliseconds(10), [&](CppTime::timer_id) { ++count; });
+			m.add(milliseconds(10), [&](CppTime::timer_id id) {
+				removed_first = m.remove(first);
+				removed_self = m.remove(id);
+				removed_third = m.remove(third);
+			});
+			third = m.add(milliseconds(10), [&](CppTime::timer_id) { ++count; });
+			m.advance(milliseconds(20));
+			REQUIRE(removed_first == false);
+			REQUIRE(removed_self == false);
+			REQUIRE(removed_third == true);
+			REQUIRE(count == 1);
+		}
+	}
+
+	SECTION("A fired one-shot timer can be removed after it is rescheduled")
+	{
+		int count = 0;
+		bool removed = false;
+		t.add(milliseconds(10), [&](CppTime::timer_id id) {
+			++count;
+			t.reschedule(id, milliseconds(10));
+			removed = t.remove(id);
+		});
+		t.advance(milliseconds(50));
+		REQUIRE(removed == true);
+		REQUIRE(count == 1);
 	}
 }
 
@@ -155,28 +394,28 @@ TEST_CASE("Test two identical timeouts")
 {
 	int i = 0;
 	int j = 0;
-	CppTime::Timer t;
-	CppTime::timestamp ts = CppTime::clock::now() + milliseconds(40);
+	Manual_timer t(poll_options());
+	Manual_timer::time_point ts = CppTime::manual_clock::now() + milliseconds(40);
 	t.add(ts, [&](CppTime::timer_id) { i = 42; });
 	t.add(ts, [&](CppTime::timer_id) { j = 43; });
-	std::this_thread::sleep_for(milliseconds(50));
+	t.advance(milliseconds(50));
 	REQUIRE(i == 42);
 	REQUIRE(j == 43);
 }
 
 TEST_CASE("Test timeouts from the past.")
 {
-	CppTime::Timer t;
+	Manual_timer t(poll_options());
 
 	SECTION("Test negative timeouts")
 	{
 		int i = 0;
 		int j = 0;
-		CppTime::timestamp ts1 = CppTime::clock::now() - milliseconds(10);
-		CppTime::timestamp ts2 = CppTime::clock::now() - milliseconds(20);
+		Manual_timer::time_point ts1 = CppTime::manual_clock::now() - milliseconds(10);
+		Manual_timer::time_point ts2 = CppTime::manual_clock::now() - milliseconds(20);
 		t.add(ts1, [&](CppTime::timer_id) { i = 42; });
 		t.add(ts2, [&](CppTime::timer_id) { j = 43; });
-		std::this_thread::sleep_for(microseconds(20));
+		t.advance(microseconds(20));
 		REQUIRE(i == 42);
 		REQUIRE(j == 43);
 	}
@@ -184,11 +423,12 @@ TEST_CASE("Test timeouts from the past.")
 	SECTION("Test time overflow when blocking timer thread.")
 	{
 		int i = 0;
-		CppTime::timestamp ts1 = CppTime::clock::now() + milliseconds(10);
-		CppTime::timestamp ts2 = CppTime::clock::now() + milliseconds(20);
-		t.add(ts1, [&](CppTime::timer_id) { std::this_thread::sleep_for(milliseconds(20)); });
+		Manual_timer::time_point ts1 = CppTime::manual_clock::now() + milliseconds(10);
+		Manual_timer::time_point ts2 = CppTime::manual_clock::now() + milliseconds(20);
+		// The first handler takes 20 ms.
+		t.add(ts1, [&](CppTime::timer_id) { CppTime::manual_clock::advance(milliseconds(20)); });
 		t.add(ts2, [&](CppTime::timer_id) { i = 42; });
-		std::this_thread::sleep_for(milliseconds(50));
+		t.advance(milliseconds(50));
 		REQUIRE(i == 42);
 	}
 }
@@ -196,28 +436,28 @@ TEST_CASE("Test timeouts from the past.")
 TEST_CASE("Test order of multiple timeouts")
 {
 	int i = 0;
-	CppTime::Timer t;
+	Manual_timer t(poll_options());
 	t.add(10000, [&](CppTime::timer_id) { i = 42; });
 	t.add(20000, [&](CppTime::timer_id) { i = 43; });
 	t.add(30000, [&](CppTime::timer_id) { i = 44; });
 	t.add(40000, [&](CppTime::timer_id) { i = 45; });
-	std::this_thread::sleep_for(milliseconds(50));
+	t.advance(milliseconds(50));
 	REQUIRE(i == 45);
 }
 
 TEST_CASE("Test with multiple timers")
 {
 	int i = 0;
-	CppTime::Timer t1;
-	CppTime::Timer t2;
+	Manual_timer t1(poll_options());
+	Manual_timer t2(poll_options());
 
 	SECTION("Update the same value at different times with different timers")
 	{
 		t1.add(milliseconds(20), [&](CppTime::timer_id) { i = 42; });
 		t1.add(milliseconds(40), [&](CppTime::timer_id) { i = 43; });
-		std::this_thread::sleep_for(milliseconds(30));
+		t1.advance(milliseconds(30));
 		REQUIRE(i == 42);
-		std::this_thread::sleep_for(milliseconds(20));
+		t1.advance(milliseconds(20));
 		REQUIRE(i == 43);
 	}
 
@@ -225,34 +465,47 @@ TEST_CASE("Test with multiple timers")
 	{
 		auto id1 = t1.add(milliseconds(20), [&](CppTime::timer_id) { i = 42; });
 		t1.add(milliseconds(40), [&](CppTime::timer_id) { i = 43; });
-		std::this_thread::sleep_for(milliseconds(10));
+		t1.advance(milliseconds(10));
 		t1.remove(id1);
-		std::this_thread::sleep_for(milliseconds(20));
+		t1.advance(milliseconds(20));
 		REQUIRE(i == 0);
-		std::this_thread::sleep_for(milliseconds(20));
+		t1.advance(milliseconds(20));
 		REQUIRE(i == 43);
 	}
 }
 
 TEST_CASE("Test remove timer_id")
 {
-	CppTime::Timer t;
+	Manual_timer t(poll_options());
 
 	SECTION("Remove out of range timer_id")
 	{
 		auto id = t.add(milliseconds(20), [](CppTime::timer_id) {});
-		std::this_thread::sleep_for(microseconds(10));
+		t.advance(microseconds(10));
 		auto res = t.remove(id + 1);
 		REQUIRE(res == false);
 	}
 
+	SECTION("Remove a stale timer_id")
+	{
+		int i = 0;
+		auto id1 = t.add(milliseconds(10), [](CppTime::timer_id) {});
+		REQUIRE(t.remove(id1) == true);
+		REQUIRE(t.remove(id1) == false);
+		auto id2 = t.add(milliseconds(10), [&](CppTime::timer_id) { i = 42; });
+		REQUIRE(t.remove(id1) == false);
+		t.advance(milliseconds(20));
+		REQUIRE(i == 42);
+		REQUIRE(t.remove(id2) == false);
+	}
+
 	SECTION("Remove timer_id and ensure handler is freed when calling remove")
 	{
 		auto shared = std::make_shared<int>(10);
 		CppTime::handler_t func = [=](CppTime::timer_id) { auto shared2 = shared; };
 		auto id = t.add(milliseconds(20), std::move(func));
 		REQUIRE(shared.use_count() == 2); // shared is copied
-		std::this_thread::sleep_for(microseconds(10));
+		t.advance(microseconds(10));
 		auto res = t.remove(id);
 		REQUIRE(res == true);
 		REQUIRE(shared.use_count() == 1); // shared in the lambda is cleaned.
@@ -264,11 +517,124 @@ TEST_CASE("Test remove timer_id")
 		CppTime::handler_t func = [=](CppTime::timer_id) { auto shared2 = shared; };
 		t.add(milliseconds(20), std::move(func));
 		REQUIRE(shared.use_count() == 2); // shared is copied
-		std::this_thread::sleep_for(milliseconds(30));
+		t.advance(milliseconds(30));
 		REQUIRE(shared.use_count() == 1); // shared in the lambda is cleaned.
 	}
 }
 
+TEST_CASE("Test reschedule")
+{
+	Manual_timer t(poll_options());
+	int i = 0;
+
+	SECTION("Postpone a timeout")
+	{
+		auto id = t.add(milliseconds(20), [&](CppTime::timer_id) { ++i; });
+		REQUIRE(t.reschedule(id, milliseconds(60)) == true);
+		REQUIRE(t.reschedule(id, milliseconds(80)) == true);
+		t.advance(milliseconds(50));
+		REQUIRE(i == 0);
+		t.advance(milliseconds(60));
+		REQUIRE(i == 1);
+		REQUIRE(t.reschedule(id, milliseconds(10)) == false);
+	}
+
+	SECTION("Bring a timeout forward")
+	{
+		auto id = t.add(hours(1), [&](CppTime::timer_id) { ++i; });
+		REQUIRE(t.reschedule(id, milliseconds(10)) == true);
+		t.advance(milliseconds(30));
+		REQUIRE(i == 1);
+	}
+
+	SECTION("Reschedule from the handler and change the period")
+	{
+		t.add(milliseconds(10), [&](CppTime::timer_id id) {
+			if(++i == 1) {
+				t.reschedule(id, milliseconds(10), milliseconds(10));
+			}
+		});
+		t.advance(milliseconds(55));
+		REQUIRE(i == 5);
+	}
+
+	SECTION("Reschedule a removed timeout")
+	{
+		auto id = t.add(milliseconds(10), [&](CppTime::timer_id) { ++i; });
+		REQUIRE(t.remove(id) == true);
+		REQUIRE(t.reschedule(id, milliseconds(10)) == false);
+	}
+}
+
+TEST_CASE("Test soft deadlines")
+{
+	Manual_timer t(poll_options());
+	std::atomic<int> i{0};
+
+	SECTION("Extend a soft deadline")
+	{
+		auto id = t.add_soft(milliseconds(20), [&](CppTime::timer_id) { ++i; });
+		for(int k = 0; k < 4; ++k) {
+			t.advance(milliseconds(10));
+			REQUIRE(t.extend(id, milliseconds(20)) == true);
+		}
+		REQUIRE(i == 0);
+		t.advance(milliseconds(40));
+		REQUIRE(i == 1);
+		REQUIRE(t.extend(id, milliseconds(20)) == false);
+	}
+
+	SECTION("An earlier deadline does not shorten the timeout")
+	{
+		auto id = t.add_soft(milliseconds(30), [&](CppTime::timer_id) { ++i; });
+		REQUIRE(t.extend(id, milliseconds(1)) == true);
+		t.advance(milliseconds(15));
+		REQUIRE(i == 0);
+		t.advance(milliseconds(35));
+		REQUIRE(i == 1);
+	}
+
+	SECTION("Only soft timeouts can be extended")
+	{
+		auto id = t.add(milliseconds(20), [&](CppTime::timer_id) { ++i; });
+		REQUIRE(t.extend(id, milliseconds(40)) == false);
+		auto soft = t.add_soft(milliseconds(20), [&](CppTime::timer_id) { ++i; });
+		REQUIRE(t.remove(soft) == true);
+		REQUIRE(t.extend(soft, milliseconds(40)) == false);
+		REQUIRE(t.extend(soft + 1000, milliseconds(40)) == false);
+	}
+
+	SECTION("A stale id does not extend a new timeout with the same deadline")
+	{
+		auto when = CppTime::manual_clock::now() + milliseconds(20);
+		auto old = t.add_soft(when, [&](CppTime::timer_id) { i += 100; });
+		REQUIRE(t.remove(old) == true);
+		auto id = t.add_soft(when, [&](CppTime::timer_id) { ++i; });
+		REQUIRE(CppTime::detail::slot_of(id) == CppTime::detail::slot_of(old));
+		REQUIRE(t.extend(old, when + milliseconds(50)) == false);
+		t.advance(milliseconds(30));
+		REQUIRE(i == 1);
+	}
+
+	SECTION("Extend from several threads")
+	{
+		auto id = t.add_soft(milliseconds(20), [&](CppTime::timer_id) { ++i; });
+		std::vector<std::thread> threads;
+		for(int k = 0; k < 4; ++k) {
+			threads.emplace_back([&]() {
+				for(int n = 0; n < 100; ++n) {
+					t.extend(id, milliseconds(20));
+				}
+			});
+		}
+		for(auto &th : threads) {
+			th.join();
+		}
+		t.advance(milliseconds(40));
+		REQUIRE(i == 1);
+	}
+}
+
 TEST_CASE("Pass an argument to an action")
 {
 	struct PushMe {
@@ -277,13 +643,1002 @@ TEST_CASE("Pass an argument to an action")
 	auto push_me = std::make_shared<PushMe>();
 	push_me->i = 41;
 
-	CppTime::Timer t;
+	Manual_timer t(poll_options());
 	int res = 0;
 
 	// Share the shared_ptr with the lambda
 	t.add(milliseconds(20), [&res, push_me](CppTime::timer_id) { res = push_me->i + 1; });
 
 	REQUIRE(res == 0);
-	std::this_thread::sleep_for(milliseconds(30));
+	t.advance(milliseconds(30));
 	REQUIRE(res == 42);
 }
+
+TEST_CASE("Test multiset queue")
+{
+	CppTime::multiset_queue::queue<CppTime::clock> q;
+	CppTime::timestamp now = CppTime::clock::now();
+	time_event te;
+
+	q.push(time_event{now + milliseconds(10), 0});
+	q.push(time_event{now + milliseconds(10), 1});
+	q.push(time_event{now + milliseconds(20), 2});
+	REQUIRE(q.erase(1) == true);
+	REQUIRE(q.erase(1) == false);
+	REQUIRE(q.erase(5) == false);
+	REQUIRE(q.pop_expired(now + milliseconds(20), te) == true);
+	REQUIRE(te.ref == 0);
+	REQUIRE(q.erase(0) == false);
+	REQUIRE(q.pop_expired(now + milliseconds(20), te) == true);
+	REQUIRE(te.ref == 2);
+	REQUIRE(q.empty());
+
+	q.push(time_event{now + milliseconds(10), 3});
+	REQUIRE(q.contains(3));
+	REQUIRE(q.update(3, now + milliseconds(30)) == true);
+	REQUIRE(q.update(4, now) == false);
+	REQUIRE(q.pop_expired(now + milliseconds(20), te) == false);
+	REQUIRE(q.pop_expired(now + milliseconds(30), te) == true);
+	REQUIRE(!q.contains(3));
+}
+
+TEST_CASE("Test multiset queue does not allocate in steady state")
+{
+	CppTime::multiset_queue::queue<CppTime::clock> q;
+	CppTime::timestamp now = CppTime::clock::now();
+	time_event te;
+	auto churn = [&]() {
+		for(std::size_t i = 0; i < 1000; ++i) {
+			q.push(time_event{now + milliseconds(i % 7), i});
+		}
+		for(std::size_t i = 0; i < 1000; i += 2) {
+			q.erase(i);
+		}
+		while(q.pop_expired(now + milliseconds(10), te)) {
+		}
+	};
+	churn();
+	std::size_t before = allocations;
+	churn();
+	churn();
+	REQUIRE(allocations == before);
+}
+
+TEST_CASE("Test heap queue")
+{
+	CppTime::heap_queue::queue<CppTime::clock> q;
+	CppTime::timestamp now = CppTime::clock::now();
+	time_event te;
+
+	SECTION("Events expire in order")
+	{
+		const int offsets[] = {50, 10, 30, 10, 70, 20, 60, 40, 30};
+		for(CppTime::timer_id id = 0; id < 9; ++id) {
+			q.push(time_event{now + milliseconds(offsets[id]), id});
+		}
+		REQUIRE(q.erase(6) == true);
+		REQUIRE(q.erase(6) == false);
+		REQUIRE(q.update(4, now + milliseconds(5)) == true);
+		REQUIRE(q.update(1, now + milliseconds(45)) == true);
+		const CppTime::timer_id order[] = {4, 3, 5, 2, 8, 7, 1, 0};
+		for(auto id : order) {
+			REQUIRE(q.pop_expired(now + milliseconds(100), te) == true);
+			REQUIRE(te.ref == id);
+		}
+		REQUIRE(q.empty());
+	}
+
+	SECTION("Only expired events are removed")
+	{
+		q.push(time_event{now + milliseconds(10), 0});
+		REQUIRE(q.next() == now + milliseconds(10));
+		REQUIRE(q.pop_expired(now, te) == false);
+		REQUIRE(q.update(0, now) == true);
+		REQUIRE(q.pop_expired(now, te) == true);
+		REQUIRE(q.update(0, now) == false);
+	}
+
+	SECTION("Add events in bulk")
+	{
+		// A small batch is sifted up, a large one rebuilds the heap.
+		std::vector<time_event> small;
+		std::vector<time_event> large;
+		for(CppTime::timer_id id = 0; id < 300; ++id) {
+			time_event e{now + milliseconds((id * 37) % 101), id};
+			if(id < 100) {
+				q.push(e);
+			} else if(id < 110) {
+				small.push_back(e);
+			} else {
+				large.push_back(e);
+			}
+		}
+		q.push(small.begin(), small.end());
+		q.push(large.begin(), large.end());
+		REQUIRE(q.erase(150) == true);
+		CppTime::timestamp last = now;
+		std::size_t n = 0;
+		while(q.pop_expired(now + milliseconds(100), te)) {
+			REQUIRE(te.next >= last);
+			last = te.next;
+			++n;
+		}
+		REQUIRE(n == 299);
+		REQUIRE(q.empty());
+	}
+}
+
+TEST_CASE("Test timer with a heap")
+{
+	CppTime::basic_timer<CppTime::heap_queue, CppTime::manual_clock> t(poll_options());
+	int i = 0;
+	size_t count = 0;
+	t.add(milliseconds(20), [&](CppTime::timer_id) { i = 42; });
+	auto id1 = t.add(milliseconds(20), [&](CppTime::timer_id) { i = 43; });
+	auto id2 = t.add(
+	    milliseconds(10), [&](CppTime::timer_id) { ++count; }, milliseconds(10));
+	t.remove(id1);
+	t.advance(milliseconds(55));
+	t.remove(id2);
+	REQUIRE(i == 42);
+	REQUIRE(count == 5);
+}
+
+TEST_CASE("Test timing wheel queue")
+{
+	CppTime::wheel_queue<milliseconds, 2>::queue<CppTime::clock> q;
+	CppTime::timestamp now = CppTime::clock::now();
+	time_event te;
+
+	SECTION("Events expire in order and never early")
+	{
+		// Level 0, level 1 and beyond the range of the wheel.
+		q.push(time_event{now + milliseconds(70000), 3});
+		q.push(time_event{now + milliseconds(300), 2});
+		q.push(time_event{now + milliseconds(10), 1});
+		REQUIRE(q.next() >= now + milliseconds(10));
+		REQUIRE(q.next() <= now + milliseconds(11));
+		REQUIRE(q.pop_expired(now + milliseconds(9), te) == false);
+		REQUIRE(q.pop_expired(now + milliseconds(11), te) == true);
+		REQUIRE(te.ref == 1);
+		REQUIRE(q.pop_expired(now + milliseconds(299), te) == false);
+		REQUIRE(q.pop_expired(now + milliseconds(301), te) == true);
+		REQUIRE(te.ref == 2);
+		REQUIRE(q.pop_expired(now + milliseconds(69999), te) == false);
+		REQUIRE(q.pop_expired(now + milliseconds(70001), te) == true);
+		REQUIRE(te.ref == 3);
+		REQUIRE(q.empty());
+	}
+
+	SECTION("Events in the same tick keep their order")
+	{
+		q.push(time_event{now + milliseconds(5), 4});
+		q.push(time_event{now + milliseconds(5), 2});
+		q.push(time_event{now - milliseconds(5), 7});
+		REQUIRE(q.pop_expired(now, te) == true);
+		REQUIRE(te.ref == 7);
+		REQUIRE(q.pop_expired(now + milliseconds(6), te) == true);
+		REQUIRE(te.ref == 4);
+		REQUIRE(q.pop_expired(now + milliseconds(6), te) == true);
+		REQUIRE(te.ref == 2);
+		REQUIRE(q.pop_expired(now + milliseconds(6), te) == false);
+	}
+
+	SECTION("Erase an event")
+	{
+		q.push(time_event{now + milliseconds(5), 0});
+		q.push(time_event{now + milliseconds(500), 1});
+		REQUIRE(q.erase(0) == true);
+		REQUIRE(q.erase(0) == false);
+		REQUIRE(q.erase(1) == true);
+		REQUIRE(q.empty());
+		REQUIRE(q.pop_expired(now + milliseconds(1000), te) == false);
+	}
+}
+
+TEST_CASE("Test timer with a timing wheel")
+{
+	CppTime::basic_timer<CppTime::wheel_queue<milliseconds>, CppTime::manual_clock> t(
+	    poll_options());
+
+	SECTION("One-shot and periodic timeouts")
+	{
+		// Start on a tick of the wheel, so that the timeouts fire exactly on time.
+		auto now = CppTime::manual_clock::now().time_since_epoch();
+		CppTime::manual_clock::advance(milliseconds(1) - now % milliseconds(1));
+		int i = 0;
+		size_t count = 0;
+		t.add(milliseconds(20), [&](CppTime::timer_id) { i = 42; });
+		auto id = t.add(
+		    milliseconds(10), [&](CppTime::timer_id) { ++count; }, milliseconds(10));
+		t.advance(milliseconds(19));
+		REQUIRE(i == 0);
+		REQUIRE(count == 1);
+		t.advance(milliseconds(1));
+		REQUIRE(i == 42);
+		REQUIRE(count == 2);
+		t.advance(milliseconds(29));
+		REQUIRE(count == 4);
+		t.advance(milliseconds(6));
+		t.remove(id);
+		REQUIRE(count == 5);
+	}
+
+	SECTION("Remove a timeout")
+	{
+		int i = 0;
+		auto id = t.add(milliseconds(20), [&](CppTime::timer_id) { i = 42; });
+		REQUIRE(t.remove(id) == true);
+		t.advance(milliseconds(30));
+		REQUIRE(i == 0);
+	}
+
+	SECTION("Reschedule a timeout")
+	{
+		int i = 0;
+		auto id = t.add(milliseconds(10), [&](CppTime::timer_id) { ++i; });
+		REQUIRE(t.reschedule(id, milliseconds(40)) == true);
+		t.advance(milliseconds(25));
+		REQUIRE(i == 0);
+		t.advance(milliseconds(40));
+		REQUIRE(i == 1);
+	}
+}
+
+TEST_CASE("Test timer with other policies")
+{
+	SECTION("Spin lock and heap queue")
+	{
+		std::atomic<int> i{0};
+		CppTime::basic_timer<CppTime::heap_queue, CppTime::clock, CppTime::handler_t,
+		    CppTime::spin_lock>
+		    t;
+		t.add(milliseconds(10), [&](CppTime::timer_id) { i = 42; });
+		REQUIRE(eventually([&] { return i == 42; }));
+	}
+
+	SECTION("System clock")
+	{
+		std::atomic<int> i{0};
+		CppTime::basic_timer<CppTime::multiset_queue, system_clock> t;
+		t.add(system_clock::now() + milliseconds(10), [&](CppTime::timer_id) { i = 42; });
+		REQUIRE(eventually([&] { return i == 42; }));
+	}
+}
+
+TEST_CASE("Test cheap clocks")
+{
+	SECTION("Coarse clock")
+	{
+		auto coarse = CppTime::coarse_clock::now();
+		auto exact = CppTime::coarse_clock::update();
+		REQUIRE(coarse <= exact);
+		REQUIRE(exact - coarse < milliseconds(20));
+		REQUIRE(CppTime::coarse_clock::ceil_now() >= exact);
+
+		// A duration is measured from the rounded up time, so it never fires early.
+		std::atomic<int> fired{0};
+		std::atomic<bool> on_time{false};
+		CppTime::basic_timer<CppTime::multiset_queue, CppTime::coarse_clock> t;
+		auto start = steady_clock::now();
+		t.add(milliseconds(10), [&](CppTime::timer_id) {
+			on_time = steady_clock::now() - start >= milliseconds(10);
+			++fired;
+		});
+		REQUIRE(eventually([&] { return fired == 1; }));
+		REQUIRE(on_time);
+	}
+
+	SECTION("TSC clock")
+	{
+		auto t1 = CppTime::tsc_clock::now();
+		auto t2 = CppTime::tsc_clock::now();
+		REQUIRE(t1 <= t2);
+		auto steady = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch());
+		auto tsc = CppTime::tsc_clock::now().time_since_epoch();
+		REQUIRE(tsc - steady < milliseconds(5));
+		REQUIRE(steady - tsc < milliseconds(5));
+		std::atomic<int> i{0};
+		CppTime::basic_timer<CppTime::multiset_queue, CppTime::tsc_clock> t;
+		t.add(milliseconds(10), [&](CppTime::timer_id) { i = 42; });
+		REQUIRE(eventually([&] { return i == 42; }));
+	}
+
+	SECTION("Cached clock")
+	{
+		// On the manual clock as source, the time only moves when it is advanced.
+		using cached = CppTime::cached_clock<CppTime::manual_clock>;
+		auto t1 = cached::update();
+		CppTime::manual_clock::advance(milliseconds(2));
+		REQUIRE(cached::now() == t1);
+		auto t2 = cached::update();
+		REQUIRE(t2 - t1 == milliseconds(2));
+		REQUIRE(cached::now() == t2);
+
+		// `process_expired()` updates the time before each batch, like the timer
+		// thread.
+		bool on_time = false;
+		CppTime::basic_timer<CppTime::multiset_queue, cached> t(poll_options());
+		auto when = cached::now() + milliseconds(10);
+		t.add(when, [&](CppTime::timer_id) { on_time = cached::now() >= when; });
+		CppTime::manual_clock::advance(milliseconds(10));
+		REQUIRE(t.process_expired() == 1);
+		REQUIRE(on_time);
+
+		// The time stands still while the timer is idle, but a duration is
+		// measured from the source clock, so it does not fire early.
+		CppTime::manual_clock::advance(milliseconds(100));
+		int i = 0;
+		t.add(milliseconds(50), [&](CppTime::timer_id) { i = 42; });
+		CppTime::manual_clock::advance(milliseconds(49));
+		t.process_expired();
+		REQUIRE(i == 0);
+		CppTime::manual_clock::advance(milliseconds(1));
+		t.process_expired();
+		REQUIRE(i == 42);
+	}
+
+	SECTION("Clock ticker")
+	{
+		using cached = CppTime::cached_clock<CppTime::coarse_clock>;
+		auto t1 = cached::update();
+		{
+			CppTime::clock_ticker<cached> ticker(milliseconds(1));
+			REQUIRE(eventually([&] { return cached::now() - t1 >= milliseconds(10); }));
+		}
+	}
+}
+
+TEST_CASE("Test inplace handler")
+{
+	using handler = CppTime::inplace_handler<64>;
+
+	SECTION("Invoke, move and free the handler")
+	{
+		auto shared = std::make_shared<int>(10);
+		CppTime::timer_id got = 0;
+		handler h = [shared, &got](CppTime::timer_id id) { got = id; };
+		REQUIRE(static_cast<bool>(h));
+		REQUIRE(shared.use_count() == 2);
+		handler h2 = std::move(h);
+		REQUIRE(!h);
+		h2(7);
+		REQUIRE(got == 7);
+		REQUIRE(shared.use_count() == 2);
+		h2 = nullptr;
+		REQUIRE(!h2);
+		REQUIRE(shared.use_count() == 1);
+	}
+
+	SECTION("Adding and firing timeouts does not allocate")
+	{
+		using Timer = CppTime::basic_timer<CppTime::heap_queue, CppTime::clock, handler>;
+		const std::size_t n = 100;
+		std::atomic<std::size_t> fired{0};
+		char payload[40] = {};
+		Timer t;
+		auto round = [&]() {
+			fired = 0;
+			for(std::size_t i = 0; i < n; ++i) {
+				// The capture is larger than the small buffer of std::function.
+				t.add(CppTime::clock::now(), [&fired, payload](CppTime::timer_id) {
+					fired += payload[0] + 1;
+				});
+			}
+			while(fired < n) {
+				std::this_thread::yield();
+			}
+		};
+		// The first round grows the timer to its working size.
+		round();
+		std::size_t before = allocations;
+		round();
+		round();
+		std::size_t after = allocations;
+		REQUIRE(after == before);
+	}
+}
+
+TEST_CASE("Test timer with an allocator")
+{
+	using handler = CppTime::inplace_handler<>;
+	using alloc = counting_allocator<char>;
+	std::atomic<std::size_t> bytes{0};
+	std::atomic<std::size_t> fired{0};
+
+	auto churn = [&](CppTime::basic_timer<CppTime::multiset_queue, CppTime::clock, handler,
+	                 std::mutex, alloc> &t) {
+		std::vector<CppTime::timer_id> ids;
+		ids.reserve(1000);
+		std::size_t before = allocations;
+		for(std::size_t i = 0; i < 1000; ++i) {
+			ids.push_back(t.add(hours(1), [](CppTime::timer_id) {}));
+		}
+		t.add(milliseconds(1), [&](CppTime::timer_id) { ++fired; });
+		for(auto id : ids) {
+			t.remove(id);
+		}
+		while(fired == 0) {
+			std::this_thread::yield();
+		}
+		REQUIRE(allocations == before);
+		REQUIRE(bytes > 0);
+	};
+
+	SECTION("Locked submission")
+	{
+		CppTime::basic_timer<CppTime::multiset_queue, CppTime::clock, handler, std::mutex, alloc>
+		    t{alloc(&bytes)};
+		churn(t);
+		REQUIRE(t.get_allocator() == alloc(&bytes));
+	}
+
+	SECTION("Lock-free submission")
+	{
+		CppTime::timer_options opts;
+		opts.lock_free_submit = true;
+		CppTime::basic_timer<CppTime::multiset_queue, CppTime::clock, handler, std::mutex, alloc>
+		    t(opts, alloc(&bytes));
+		churn(t);
+	}
+}
+
+TEST_CASE("Test remove while a batch runs")
+{
+	CppTime::Timer t;
+	std::atomic<bool> started{false};
+	std::atomic<bool> removed{false};
+	std::atomic<int> count{0};
+	auto when = CppTime::clock::now() + milliseconds(10);
+	// The first handler of the batch waits until the others are removed.
+	t.add(when, [&](CppTime::timer_id) {
+		started = true;
+		while(!removed) {
+			std::this_thread::yield();
+		}
+		++count;
+	});
+	std::vector<CppTime::timer_id> ids;
+	for(int i = 0; i < 200; ++i) {
+		ids.push_back(t.add(when, [&](CppTime::timer_id) { ++count; }));
+	}
+	while(!started) {
+		std::this_thread::yield();
+	}
+	std::size_t n = 0;
+	for(auto id : ids) {
+		n += t.remove(id) ? 1 : 0;
+	}
+	removed = true;
+	std::this_thread::sleep_for(milliseconds(20));
+	REQUIRE(n == 200);
+	REQUIRE(count == 1);
+}
+
+TEST_CASE("Test timer with a thread pool")
+{
+	// The counters outlive the timer and the pool, since a handler may still run
+	// on the pool after it has been removed.
+	std::atomic<int> count{0};
+	std::atomic<int> running{0};
+	std::atomic<int> overlap{0};
+	CppTime::thread_pool pool(2);
+	CppTime::Timer t(pool);
+
+	SECTION("A slow handler does not delay other timeouts")
+	{
+		std::atomic<int> i{0};
+		t.add(milliseconds(10),
+		    [](CppTime::timer_id) { std::this_thread::sleep_for(milliseconds(50)); });
+		t.add(milliseconds(20), [&](CppTime::timer_id) { i = 42; });
+		std::this_thread::sleep_for(milliseconds(35));
+		REQUIRE(i == 42);
+	}
+
+	SECTION("A periodic handler does not run concurrently with itself")
+	{
+		auto id = t.add(
+		    milliseconds(5),
+		    [&](CppTime::timer_id) {
+			    if(++running > 1) {
+				    ++overlap;
+			    }
+			    std::this_thread::sleep_for(milliseconds(10));
+			    ++count;
+			    --running;
+		    },
+		    milliseconds(2));
+		REQUIRE(eventually([&] { return count >= 3; }));
+		t.remove(id);
+		REQUIRE(overlap == 0);
+	}
+
+	SECTION("Remove a timeout from its handler")
+	{
+		t.add(
+		    milliseconds(5),
+		    [&](CppTime::timer_id id) {
+			    ++count;
+			    t.remove(id);
+		    },
+		    milliseconds(5));
+		std::this_thread::sleep_for(milliseconds(30));
+		REQUIRE(count == 1);
+	}
+
+	SECTION("Reschedule a one-shot timeout from its handler")
+	{
+		t.add(milliseconds(5), [&](CppTime::timer_id id) {
+			if(++count == 1) {
+				t.reschedule(id, milliseconds(5));
+			}
+		});
+		REQUIRE(eventually([&] { return count == 2; }));
+	}
+}
+
+TEST_CASE("Test lock-free submission")
+{
+	CppTime::timer_options opts;
+	opts.lock_free_submit = true;
+	CppTime::Timer t(opts);
+
+	SECTION("An earlier timeout wakes up the timer thread")
+	{
+		std::atomic<int> i{0};
+		t.add(seconds(10), [&](CppTime::timer_id) { i = 43; });
+		std::this_thread::sleep_for(milliseconds(5));
+		t.add(milliseconds(10), [&](CppTime::timer_id) { i = 42; });
+		REQUIRE(eventually([&] { return i == 42; }));
+	}
+
+	SECTION("Add and remove from several threads")
+	{
+		std::atomic<int> count{0};
+		std::vector<std::thread> producers;
+		for(int p = 0; p < 4; ++p) {
+			producers.emplace_back([&]() {
+				for(int k = 0; k < 100; ++k) {
+					auto id = t.add(milliseconds(10), [&](CppTime::timer_id) { count += 100; });
+					t.remove(id);
+					t.add(milliseconds(10), [&](CppTime::timer_id) { ++count; });
+				}
+			});
+		}
+		for(auto &p : producers) {
+			p.join();
+		}
+		REQUIRE(eventually([&] { return count >= 400; }));
+		REQUIRE(count == 400);
+	}
+
+	SECTION("Remove out of range timer_id")
+	{
+		auto id = t.add(milliseconds(20), [](CppTime::timer_id) {});
+		REQUIRE(t.remove(id + 1) == false);
+		REQUIRE(t.remove(id) == true);
+	}
+
+	SECTION("Remove a stale timer_id")
+	{
+		CppTime::timer_options o = poll_options();
+		o.lock_free_submit = true;
+		Manual_timer m(o);
+		int i = 0;
+		auto id1 = m.add(milliseconds(5), [&](CppTime::timer_id) { ++i; });
+		m.advance(milliseconds(10));
+		REQUIRE(i == 1);
+		REQUIRE(m.remove(id1) == false);
+		auto id2 = m.add(milliseconds(10), [&](CppTime::timer_id) { ++i; });
+		REQUIRE(CppTime::detail::slot_of(id2) == CppTime::detail::slot_of(id1));
+		REQUIRE(m.remove(id1) == false);
+		REQUIRE(m.remove(id2) == true);
+		REQUIRE(m.remove(id2) == false);
+		m.advance(milliseconds(20));
+		REQUIRE(i == 1);
+	}
+
+	SECTION("Remove a timer_id before its timer is inserted")
+	{
+		// In poll mode, the submitted timers are inserted by `advance()`.
+		CppTime::timer_options o = poll_options();
+		o.lock_free_submit = true;
+		Manual_timer m(o);
+		int i = 0;
+		std::vector<CppTime::timer_id> ids;
+		for(int k = 0; k < 100; ++k) {
+			ids.push_back(m.add(milliseconds(10), [&](CppTime::timer_id) { ++i; }));
+		}
+		for(auto id : ids) {
+			REQUIRE(m.remove(id) == true);
+			REQUIRE(m.remove(id) == false);
+		}
+		REQUIRE(m.remove(ids.back() + 1) == false);
+		m.advance(milliseconds(20));
+		REQUIRE(i == 0);
+	}
+}
+
+TEST_CASE("Test wakeups of the timer thread")
+{
+	CppTime::Timer t;
+	std::this_thread::sleep_for(milliseconds(5));
+
+	SECTION("Later timeouts do not wake up the timer thread")
+	{
+		t.add(seconds(10), [](CppTime::timer_id) {});
+		for(int i = 0; i < 100; ++i) {
+			t.add(seconds(20 + i), [](CppTime::timer_id) {});
+		}
+		std::this_thread::sleep_for(milliseconds(5));
+		REQUIRE(t.stats().notifications == 1);
+		REQUIRE(t.stats().wakeups >= 1);
+		REQUIRE(t.stats().wakeups <= 2);
+	}
+
+	SECTION("An earlier timeout wakes up the timer thread")
+	{
+		std::atomic<int> i{0};
+		t.add(seconds(10), [](CppTime::timer_id) {});
+		std::this_thread::sleep_for(milliseconds(5));
+		t.add(seconds(5), [](CppTime::timer_id) {});
+		std::this_thread::sleep_for(milliseconds(5));
+		t.add(milliseconds(10), [&](CppTime::timer_id) { i = 42; });
+		REQUIRE(eventually([&] { return i == 42; }));
+		REQUIRE(t.stats().notifications == 3);
+	}
+}
+
+TEST_CASE("Test bulk add and remove")
+{
+	SECTION("Add and remove many timeouts")
+	{
+		Manual_timer t(poll_options());
+		std::vector<int> fired;
+		std::vector<Manual_timer::bulk_timeout> timeouts;
+		auto now = CppTime::manual_clock::now();
+		for(int i = 0; i < 100; ++i) {
+			timeouts.push_back({now + milliseconds(100 - i),
+			    [&fired, i](CppTime::timer_id) { fired.push_back(i); }});
+		}
+		auto ids = t.add_bulk(timeouts);
+		REQUIRE(ids.size() == 100);
+		std::vector<CppTime::timer_id> odd;
+		for(std::size_t i = 1; i < ids.size(); i += 2) {
+			odd.push_back(ids[i]);
+		}
+		REQUIRE(t.remove_bulk(odd) == 50);
+		REQUIRE(t.remove_bulk(odd) == 0);
+		t.advance(milliseconds(200));
+		REQUIRE(fired.size() == 50);
+		for(std::size_t i = 0; i < fired.size(); ++i) {
+			REQUIRE(fired[i] == 98 - 2 * int(i));
+		}
+	}
+
+	SECTION("Periodic timeouts in a heap")
+	{
+		CppTime::basic_timer<CppTime::heap_queue, CppTime::manual_clock> t(poll_options());
+		int count = 0;
+		t.add(milliseconds(5), [&](CppTime::timer_id) { ++count; });
+		std::vector<CppTime::basic_timer<CppTime::heap_queue,
+		    CppTime::manual_clock>::bulk_timeout>
+		    timeouts;
+		auto now = CppTime::manual_clock::now();
+		for(int i = 0; i < 10; ++i) {
+			timeouts.push_back({now + milliseconds(10 + i), [&](CppTime::timer_id) { ++count; },
+			    milliseconds(10)});
+		}
+		auto ids = t.add_bulk(std::move(timeouts));
+		t.advance(milliseconds(35));
+		REQUIRE(count == 27);
+		REQUIRE(t.remove_bulk(ids) == 10);
+		t.advance(milliseconds(35));
+		REQUIRE(count == 27);
+	}
+
+	SECTION("The timer thread is woken up once")
+	{
+		CppTime::Timer t;
+		std::atomic<int> count{0};
+		std::this_thread::sleep_for(milliseconds(5));
+		std::vector<CppTime::Timer::bulk_timeout> timeouts;
+		for(int i = 0; i < 100; ++i) {
+			timeouts.push_back(
+			    {CppTime::clock::now() + milliseconds(10), [&](CppTime::timer_id) { ++count; }});
+		}
+		t.add_bulk(timeouts);
+		REQUIRE(eventually([&] { return count == 100; }));
+		REQUIRE(t.stats().notifications == 1);
+	}
+}
+
+TEST_CASE("Test timer slack")
+{
+	CppTime::timer_options opts;
+	opts.slack = milliseconds(40);
+	CppTime::Timer t(opts);
+	std::this_thread::sleep_for(milliseconds(5));
+	std::atomic<int> i{0};
+
+	SECTION("Nearby timeouts fire in one wakeup")
+	{
+		auto start = CppTime::clock::now();
+		for(int k = 0; k < 10; ++k) {
+			t.add(start + milliseconds(10 + 2 * k), [&](CppTime::timer_id) { ++i; });
+		}
+		std::this_thread::sleep_for(milliseconds(25));
+		REQUIRE(i == 0);
+		REQUIRE(eventually([&] { return i == 10; }));
+		auto stats = t.stats();
+		REQUIRE(stats.wakeups <= 2);
+		REQUIRE(stats.fired == 10);
+		REQUIRE(stats.max_lateness >= milliseconds(20));
+		REQUIRE(stats.lateness >= stats.max_lateness);
+	}
+}
+
+TEST_CASE("Test precise timeouts")
+{
+	Manual_timer t(poll_options());
+	int i = 0;
+
+	SECTION("Precise and normal timeouts fire in order")
+	{
+		std::vector<int> order;
+		t.add(milliseconds(20), [&](CppTime::timer_id) { order.push_back(2); });
+		t.add_precise(milliseconds(10), [&](CppTime::timer_id) { order.push_back(1); });
+		t.add_precise(milliseconds(30), [&](CppTime::timer_id) { order.push_back(3); });
+		t.advance(milliseconds(10));
+		t.advance(milliseconds(10));
+		t.advance(milliseconds(10));
+		REQUIRE(order == std::vector<int>({1, 2, 3}));
+	}
+
+	SECTION("A precise timeout does not fire early")
+	{
+		// The timer thread spins on the real clock before the deadline.
+		CppTime::timer_options opts;
+		opts.spin_margin = microseconds(500);
+		CppTime::Timer rt(opts);
+		std::atomic<int> n{0};
+		auto when = CppTime::clock::now() + milliseconds(10);
+		CppTime::timestamp fired_at;
+		rt.add_precise(when, [&](CppTime::timer_id) {
+			fired_at = CppTime::clock::now();
+			++n;
+		});
+		REQUIRE(eventually([&] { return n == 1; }));
+		REQUIRE(fired_at >= when);
+	}
+
+	SECTION("Remove and reschedule a precise timeout")
+	{
+		auto id1 = t.add_precise(milliseconds(10), [&](CppTime::timer_id) { i += 1; });
+		auto id2 = t.add_precise(milliseconds(10), [&](CppTime::timer_id) { i += 10; });
+		REQUIRE(t.remove(id1) == true);
+		REQUIRE(t.reschedule(id2, milliseconds(30)) == true);
+		t.advance(milliseconds(29));
+		REQUIRE(i == 0);
+		t.advance(milliseconds(1));
+		REQUIRE(i == 10);
+	}
+
+	SECTION("Periodic precise timeouts")
+	{
+		auto id = t.add_precise(
+		    milliseconds(5), [&](CppTime::timer_id) { ++i; }, milliseconds(5));
+		t.advance(milliseconds(28));
+		REQUIRE(t.remove(id) == true);
+		REQUIRE(i == 5);
+	}
+}
+
+TEST_CASE("Test timer with kernel wait")
+{
+	CppTime::timer_options opts;
+	opts.kernel_wait = true;
+	CppTime::Timer t(opts);
+	std::atomic<int> i{0};
+
+	SECTION("An earlier timeout wakes up the timer thread")
+	{
+		t.add(seconds(10), [](CppTime::timer_id) {});
+		std::this_thread::sleep_for(milliseconds(5));
+		t.add(milliseconds(10), [&](CppTime::timer_id) { ++i; });
+		REQUIRE(eventually([&] { return i == 1; }));
+	}
+
+	SECTION("Periodic and removed timeouts")
+	{
+		auto id = t.add(milliseconds(5), [&](CppTime::timer_id) { ++i; }, milliseconds(5));
+		auto removed = t.add(milliseconds(10), [&](CppTime::timer_id) { i += 100; });
+		REQUIRE(t.remove(removed) == true);
+		REQUIRE(eventually([&] { return i >= 4; }));
+		t.remove(id);
+		REQUIRE(i < 100);
+	}
+
+	SECTION("System clock")
+	{
+		CppTime::basic_timer<CppTime::heap_queue, std::chrono::system_clock> st(opts);
+		st.add(milliseconds(10), [&](CppTime::timer_id) { ++i; });
+		REQUIRE(eventually([&] { return i == 1; }));
+	}
+
+#if defined(__linux__)
+	SECTION("A failing epoll_wait() is not retried")
+	{
+		// Find the epoll descriptor of a new Kernel_wait, and close it.
+		auto epoll_fds = []() {
+			std::vector<int> fds;
+			char path[64];
+			char link[64];
+			for(int fd = 0; fd < 1024; ++fd) {
+				snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+				ssize_t n = readlink(path, link, sizeof(link) - 1);
+				if(n > 0 && std::string(link, std::size_t(n)) == "anon_inode:[eventpoll]") {
+					fds.push_back(fd);
+				}
+			}
+			return fds;
+		};
+		auto before = epoll_fds();
+		CppTime::detail::Kernel_wait k;
+		k.open(CLOCK_MONOTONIC);
+		REQUIRE(k.valid());
+		auto after = epoll_fds();
+		REQUIRE(after.size() == before.size() + 1);
+		for(int fd : after) {
+			if(std::find(before.begin(), before.end(), fd) == before.end()) {
+				close(fd);
+			}
+		}
+		k.wait();
+		REQUIRE(k.valid() == false);
+	}
+#endif
+}
+
+TEST_CASE("Test timer in poll mode")
+{
+	using Timer = CppTime::basic_timer<CppTime::heap_queue, CppTime::clock,
+	    CppTime::inplace_handler<>, CppTime::null_lock>;
+	CppTime::timer_options opts;
+	opts.poll = true;
+	Timer t(opts);
+	CppTime::timestamp start = CppTime::clock::now();
+	int i = 0;
+
+	SECTION("Handlers run in process_expired")
+	{
+		REQUIRE(t.next_deadline() == CppTime::timestamp::max());
+		t.add(start + milliseconds(20), [&](CppTime::timer_id) { i += 10; });
+		t.add(start + milliseconds(10), [&](CppTime::timer_id) { i += 1; });
+		REQUIRE(t.next_deadline() == start + milliseconds(10));
+		REQUIRE(t.process_expired(start + milliseconds(5)) == 0);
+		REQUIRE(i == 0);
+		REQUIRE(t.process_expired(start + milliseconds(10)) == 1);
+		REQUIRE(i == 1);
+		REQUIRE(t.next_deadline() == start + milliseconds(20));
+		REQUIRE(t.process_expired(start + milliseconds(30)) == 1);
+		REQUIRE(i == 11);
+		REQUIRE(t.next_deadline() == CppTime::timestamp::max());
+	}
+
+	SECTION("Periodic timeouts are renewed")
+	{
+		auto id = t.add(
+		    start + milliseconds(10), [&](CppTime::timer_id) { ++i; }, milliseconds(10));
+		for(int k = 1; k <= 5; ++k) {
+			REQUIRE(t.process_expired(start + milliseconds(10 * k)) == 1);
+		}
+		REQUIRE(i == 5);
+		REQUIRE(t.next_deadline() == start + milliseconds(60));
+		REQUIRE(t.remove(id) == true);
+		REQUIRE(t.next_deadline() == CppTime::timestamp::max());
+	}
+
+	SECTION("No timer thread runs the handlers")
+	{
+		t.add(start, [&](CppTime::timer_id) { ++i; });
+		std::this_thread::sleep_for(milliseconds(5));
+		REQUIRE(i == 0);
+		REQUIRE(t.process_expired() == 1);
+		REQUIRE(i == 1);
+	}
+}
+
+#if defined(__linux__)
+TEST_CASE("Test pollable timer")
+{
+	CppTime::timer_options opts;
+	opts.poll = true;
+	opts.pollable = true;
+	CppTime::Timer t(opts);
+	REQUIRE(t.fd() >= 0);
+	pollfd p = {t.fd(), POLLIN, 0};
+	int i = 0;
+
+	SECTION("The descriptor is readable when a timeout is due")
+	{
+		REQUIRE(::poll(&p, 1, 5) == 0);
+		t.add(hours(1), [&](CppTime::timer_id) { i += 10; });
+		t.add(milliseconds(10), [&](CppTime::timer_id) { ++i; });
+		REQUIRE(::poll(&p, 1, 5) == 0);
+		REQUIRE(::poll(&p, 1, 1000) == 1);
+		REQUIRE(t.dispatch_ready() == 1);
+		REQUIRE(i == 1);
+		REQUIRE(::poll(&p, 1, 5) == 0);
+	}
+
+	SECTION("Periodic timeouts re-arm the descriptor")
+	{
+		t.add(milliseconds(5), [&](CppTime::timer_id) { ++i; }, milliseconds(5));
+		while(i < 3) {
+			REQUIRE(::poll(&p, 1, 1000) == 1);
+			t.dispatch_ready();
+		}
+		REQUIRE(i == 3);
+	}
+
+	SECTION("Timeouts added with lock-free submission arm the descriptor")
+	{
+		opts.lock_free_submit = true;
+		CppTime::Timer ts(opts);
+		pollfd ps = {ts.fd(), POLLIN, 0};
+		ts.add(hours(1), [&](CppTime::timer_id) { i += 10; });
+		ts.add(milliseconds(10), [&](CppTime::timer_id) { ++i; });
+		REQUIRE(::poll(&ps, 1, 1000) == 1);
+		REQUIRE(ts.dispatch_ready() == 1);
+		REQUIRE(i == 1);
+	}
+}
+#endif
+
+TEST_CASE("Test sharded timer")
+{
+	CppTime::ShardedTimer t(4);
+	REQUIRE(t.size() == 4);
+
+	SECTION("Timeouts fire on the shard of their key")
+	{
+		std::atomic<int> count{0};
+		std::vector<CppTime::timer_id> ids;
+		for(std::size_t key = 0; key < 8; ++key) {
+			ids.push_back(t.add_keyed(key, milliseconds(10), [&](CppTime::timer_id) { ++count; }));
+		}
+		ids.push_back(t.add(milliseconds(10), [&](CppTime::timer_id) { ++count; }));
+		std::sort(ids.begin(), ids.end());
+		REQUIRE(std::unique(ids.begin(), ids.end()) == ids.end());
+		REQUIRE(eventually([&] { return count == 9; }));
+	}
+
+	SECTION("Remove a timeout with its sharded id")
+	{
+		std::atomic<int> count{0};
+		auto id = t.add_keyed(3, milliseconds(10), [&](CppTime::timer_id) { count += 10; });
+		t.add_keyed(
+		    2, milliseconds(5),
+		    [&](CppTime::timer_id id) {
+			    ++count;
+			    t.remove(id);
+		    },
+		    milliseconds(5));
+		REQUIRE(t.remove(id) == true);
+		std::this_thread::sleep_for(milliseconds(30));
+		REQUIRE(count == 1);
+	}
+	SECTION("Threads are only pinned on request")
+	{
+		REQUIRE(t.pinned() == false);
+#if defined(__linux__)
+		cpu_set_t allowed;
+		REQUIRE(sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+		CppTime::ShardedTimer p(1, true);
+		REQUIRE(p.pinned() == (CPU_ISSET(0, &allowed) != 0));
+#endif
+		CppTime::ShardedTimer q(1, true, poll_options());
+		REQUIRE(q.pinned() == false);
+	}
+}